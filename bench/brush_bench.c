@@ -0,0 +1,141 @@
+// Times brush strokes swept row by row (brush_stroke) against stamping the
+// mask at every pixel of the same Bresenham path, for a range of radii and
+// directions, and checks that both paint exactly the same pixels. Needs no
+// SDL; build and run it with `make bench`. Exits with 1 if any case differs.
+
+#include "brush.h"
+#include "framebuffer.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_SIZE 1024
+#define BENCH_STROKES 32 // per case, each 256 pixels along its major axis
+#define BENCH_REPEATS 5  // the fastest run of each case is reported
+
+typedef struct {
+  const char *name;
+  int dx;
+  int dy;
+} BenchPath;
+
+static const BenchPath bench_paths[] = {
+    {"horizontal", 4, 0},
+    {"diagonal", 4, 4},
+    {"steep", 1, 4},
+};
+
+static const int bench_radii[] = {1, 4, 8, 16, 32, 64};
+
+typedef void (*StrokeFn)(Framebuffer *fb, const BrushMask *mask, int x0,
+                         int y0, int x1, int y1, uint32_t color);
+
+static double now_seconds(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// The reference: one stamp per path pixel, clipped the way brush_stroke clips.
+static void stroke_stamped(Framebuffer *fb, const BrushMask *mask, int x0,
+                           int y0, int x1, int y1, uint32_t color) {
+  int r = mask->radius;
+  FbLine line;
+  if (!fb_line_clip(&line, x0, y0, x1, y1, -r, -r, fb->width - 1 + r,
+                    fb->height - 1 + r))
+    return;
+  do {
+    brush_stamp(fb, mask, line.x, line.y, color, NULL);
+  } while (fb_line_next(&line));
+}
+
+static void stroke_swept(Framebuffer *fb, const BrushMask *mask, int x0,
+                         int y0, int x1, int y1, uint32_t color) {
+  brush_stroke(fb, mask, x0, y0, x1, y1, color, NULL);
+}
+
+// Spreads the strokes of a case over the canvas, every other one drawn
+// backwards, each in its own color so a pixel painted by the wrong stroke
+// shows up when the two canvases are compared.
+static double run_case(Framebuffer *fb, const BrushMask *mask,
+                       const BenchPath *path, StrokeFn stroke) {
+  int major = path->dx > path->dy ? path->dx : path->dy;
+  int len_x = path->dx * 256 / major;
+  int len_y = path->dy * 256 / major;
+
+  fb_clear(fb, 0);
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_STROKES; i++) {
+    int x0 = 64 + (i * 97) % (BENCH_SIZE - 384);
+    int y0 = 64 + (i * 61) % (BENCH_SIZE - 384);
+    int x1 = x0 + len_x;
+    int y1 = y0 + len_y;
+    uint32_t color = ARGB(255, i * 7, i * 13, i * 29);
+    if (i % 2)
+      stroke(fb, mask, x1, y1, x0, y0, color);
+    else
+      stroke(fb, mask, x0, y0, x1, y1, color);
+  }
+  return now_seconds() - start;
+}
+
+static int same_pixels(const Framebuffer *a, const Framebuffer *b) {
+  for (int y = 0; y < a->height; y++) {
+    for (int x = 0; x < a->width; x++) {
+      if (fb_get_pixel(a, x, y, 0) != fb_get_pixel(b, x, y, 0))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  Framebuffer stamped;
+  Framebuffer swept;
+  if (!fb_init(&stamped, BENCH_SIZE, BENCH_SIZE))
+    return 1;
+  if (!fb_init(&swept, BENCH_SIZE, BENCH_SIZE)) {
+    fb_destroy(&stamped);
+    return 1;
+  }
+  BrushCache brushes;
+  brush_cache_init(&brushes);
+
+  printf("%d strokes per case on a %dx%d canvas, best of %d runs\n\n",
+         BENCH_STROKES, BENCH_SIZE, BENCH_SIZE, BENCH_REPEATS);
+  printf("radius  path        stamped us  swept us  speedup  coverage\n");
+
+  int mismatches = 0;
+  int radius_count = (int)(sizeof(bench_radii) / sizeof(bench_radii[0]));
+  int path_count = (int)(sizeof(bench_paths) / sizeof(bench_paths[0]));
+  for (int r = 0; r < radius_count; r++) {
+    const BrushMask *mask =
+        brush_cache_get(&brushes, BRUSH_SHAPE_ROUND, bench_radii[r]);
+    for (int p = 0; p < path_count; p++) {
+      const BenchPath *path = &bench_paths[p];
+      double best_stamped = 0.0;
+      double best_swept = 0.0;
+      for (int rep = 0; rep < BENCH_REPEATS; rep++) {
+        double t = run_case(&stamped, mask, path, stroke_stamped);
+        if (rep == 0 || t < best_stamped)
+          best_stamped = t;
+        t = run_case(&swept, mask, path, stroke_swept);
+        if (rep == 0 || t < best_swept)
+          best_swept = t;
+      }
+
+      int same = same_pixels(&stamped, &swept);
+      if (!same)
+        mismatches++;
+      printf("%6d  %-10s  %10.1f  %8.1f  %6.1fx  %s\n", bench_radii[r],
+             path->name, best_stamped * 1e6 / BENCH_STROKES,
+             best_swept * 1e6 / BENCH_STROKES,
+             best_swept > 0.0 ? best_stamped / best_swept : 0.0,
+             same ? "same" : "DIFFERENT");
+    }
+  }
+
+  fb_destroy(&stamped);
+  fb_destroy(&swept);
+  return mismatches ? 1 : 0;
+}
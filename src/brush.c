@@ -1,44 +1,269 @@
 #include "brush.h"
 
-static int iabs(int v) { return v < 0 ? -v : v; }
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
-void brush_stamp_circle(Framebuffer *fb, int cx, int cy, int radius,
-                        uint32_t color) {
-  if (radius <= 0) {
-    fb_put_pixel(fb, cx, cy, color);
+static void mask_build_round(BrushMask *mask, int radius) {
+  int r2 = radius * radius;
+  int half = radius;
+  for (int y = 0; y <= radius; y++) {
+    while (half * half + y * y > r2) {
+      half--;
+    }
+    BrushSpan span = {(int16_t)-half, (int16_t)half};
+    mask->spans[radius + y] = span;
+    mask->spans[radius - y] = span;
+  }
+}
+
+void brush_cache_init(BrushCache *cache) {
+  memset(cache, 0, sizeof(*cache));
+  cache->current = brush_cache_select(cache, BRUSH_SHAPE_ROUND, 1);
+}
+
+const BrushMask *brush_cache_get(BrushCache *cache, BrushShape shape,
+                                 int radius) {
+  if (shape < 0 || shape >= BRUSH_SHAPE_COUNT)
+    shape = BRUSH_SHAPE_ROUND;
+  if (radius < 0)
+    radius = 0;
+  if (radius > BRUSH_MAX_RADIUS)
+    radius = BRUSH_MAX_RADIUS;
+
+  BrushMask *mask = &cache->masks[shape][radius];
+  if (!mask->built) {
+    mask->radius = radius;
+    switch (shape) {
+    case BRUSH_SHAPE_ROUND:
+    default:
+      mask_build_round(mask, radius);
+      break;
+    }
+    mask->built = 1;
+  }
+  return mask;
+}
+
+const BrushMask *brush_cache_select(BrushCache *cache, BrushShape shape,
+                                    int radius) {
+  cache->current = brush_cache_get(cache, shape, radius);
+  return cache->current;
+}
+
+_Static_assert(FB_TILE_SIZE == 64, "coverage rows are one 64-bit word");
+
+void brush_coverage_init(BrushCoverage *cov) {
+  memset(cov, 0, sizeof(*cov));
+}
+
+void brush_coverage_destroy(BrushCoverage *cov) {
+  for (int i = 0; cov->tiles && i < cov->tiles_x * cov->tiles_y; i++) {
+    free(cov->tiles[i]);
+  }
+  free(cov->tiles);
+  memset(cov, 0, sizeof(*cov));
+}
+
+int brush_coverage_begin(BrushCoverage *cov, int width, int height) {
+  if (cov->tiles && cov->width == width && cov->height == height) {
+    for (int i = 0; i < cov->tiles_x * cov->tiles_y; i++) {
+      free(cov->tiles[i]);
+      cov->tiles[i] = NULL;
+    }
+    return 1;
+  }
+
+  brush_coverage_destroy(cov);
+  int tiles_x = (width + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  int tiles_y = (height + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  cov->tiles = (uint64_t **)calloc((size_t)tiles_x * tiles_y,
+                                   sizeof(uint64_t *));
+  if (!cov->tiles)
+    return 0;
+  cov->width = width;
+  cov->height = height;
+  cov->tiles_x = tiles_x;
+  cov->tiles_y = tiles_y;
+  return 1;
+}
+
+// Fills the pixels of [x0, x1] on row y that the stroke has not painted yet,
+// and records them as painted.
+static void paint_span(Framebuffer *fb, BrushCoverage *cov, int x0, int x1,
+                       int y, uint32_t color) {
+  if (!cov || !cov->tiles) {
+    fb_fill_span(fb, x0, x1, y, color);
     return;
   }
+  if (y < 0 || y >= cov->height)
+    return;
+  if (x0 < 0)
+    x0 = 0;
+  if (x1 > cov->width - 1)
+    x1 = cov->width - 1;
 
-  int r2 = radius * radius;
-  for (int y = -radius; y <= radius; y++) {
-    for (int x = -radius; x <= radius; x++) {
-      if (x * x + y * y <= r2) {
-        fb_put_pixel(fb, cx + x, cy + y, color);
-      }
+  int ty = y >> FB_TILE_SHIFT;
+  for (int tx = x0 >> FB_TILE_SHIFT; tx <= (x1 >> FB_TILE_SHIFT); tx++) {
+    int base = tx << FB_TILE_SHIFT;
+    int lo = x0 > base ? x0 - base : 0;
+    int hi = x1 < base + FB_TILE_MASK ? x1 - base : FB_TILE_MASK;
+    uint64_t want = (~(uint64_t)0 << lo) & (~(uint64_t)0 >> (63 - hi));
+
+    uint64_t **slot = &cov->tiles[ty * cov->tiles_x + tx];
+    if (!*slot)
+      *slot = (uint64_t *)calloc(FB_TILE_SIZE, sizeof(uint64_t));
+    if (!*slot) {
+      // Out of memory: paint without tracking rather than not at all.
+      fb_fill_span(fb, base + lo, base + hi, y, color);
+      continue;
+    }
+    uint64_t *row = &(*slot)[y & FB_TILE_MASK];
+    uint64_t todo = want & ~*row;
+    *row |= want;
+    while (todo) {
+      int start = __builtin_ctzll(todo);
+      uint64_t rest = ~(todo >> start);
+      int len = rest ? __builtin_ctzll(rest) : 64 - start;
+      fb_fill_span(fb, base + start, base + start + len - 1, y, color);
+      todo &= len + start >= 64 ? 0 : ~(uint64_t)0 << (start + len);
     }
   }
 }
 
-void brush_stroke_circle(Framebuffer *fb, int x0, int y0, int x1, int y1,
-                         int radius, uint32_t color) {
-  int dx = iabs(x1 - x0);
-  int sx = (x0 < x1) ? 1 : -1;
-  int dy = -iabs(y1 - y0);
-  int sy = (y0 < y1) ? 1 : -1;
-  int err = dx + dy;
-
-  for (;;) {
-    brush_stamp_circle(fb, x0, y0, radius, color);
-    if (x0 == x1 && y0 == y1)
-      break;
-    int e2 = 2 * err;
-    if (e2 >= dy) {
-      err += dy;
-      x0 += sx;
+void brush_stamp(Framebuffer *fb, const BrushMask *mask, int cx, int cy,
+                 uint32_t color, BrushCoverage *coverage) {
+  int rows = 2 * mask->radius + 1;
+  int top = cy - mask->radius;
+  for (int i = 0; i < rows; i++) {
+    paint_span(fb, coverage, cx + mask->spans[i].x0, cx + mask->spans[i].x1,
+               top + i, color);
+  }
+}
+
+// Bresenham walk that stamps the mask at every step. Only used as a fallback
+// when the swept-row buffers cannot be allocated.
+static void stroke_stamped(Framebuffer *fb, const BrushMask *mask,
+                           const FbLine *path, uint32_t color,
+                           BrushCoverage *coverage) {
+  FbLine line = *path;
+  do {
+    brush_stamp(fb, mask, line.x, line.y, color, coverage);
+  } while (fb_line_next(&line));
+}
+
+// Widens the swept extent of every visible row a run of path pixels on row
+// `y`, covering columns [xa, xb], reaches through the mask.
+static void sweep_run(const BrushMask *mask, int xa, int xb, int y, int top,
+                      int rows, int *lo, int *hi) {
+  int count = 2 * mask->radius + 1;
+  int first = y - mask->radius - top;
+  for (int i = 0; i < count; i++) {
+    int row = first + i;
+    if (row < 0 || row >= rows)
+      continue;
+    int l = xa + mask->spans[i].x0;
+    int h = xb + mask->spans[i].x1;
+    if (l < lo[row])
+      lo[row] = l;
+    if (h > hi[row])
+      hi[row] = h;
+  }
+}
+
+// Fills the shape swept by stamping the mask along the Bresenham line from
+// (x0, y0) to (x1, y1), writing every covered pixel exactly once.
+//
+// The path is monotone and moves at most one pixel per step, and every mask
+// row covers the center column, so the stamps reaching any given row overlap
+// or touch each other: their union on that row is a single span. Each run of
+// path pixels sharing a row therefore only widens the per-row extents, and the
+// rows are filled once at the end.
+void brush_stroke(Framebuffer *fb, const BrushMask *mask, int x0, int y0,
+                  int x1, int y1, uint32_t color, BrushCoverage *coverage) {
+  // Only path pixels within a radius of the canvas can reach it.
+  int r = mask->radius;
+  FbLine path;
+  if (!fb_line_clip(&path, x0, y0, x1, y1, -r, -r, fb->width - 1 + r,
+                    fb->height - 1 + r))
+    return;
+
+  int top = (path.y < path.last_y ? path.y : path.last_y) - r;
+  int bottom = (path.y > path.last_y ? path.y : path.last_y) + r;
+  if (top < 0)
+    top = 0;
+  if (bottom > fb->height - 1)
+    bottom = fb->height - 1;
+  int rows = bottom - top + 1;
+
+  int stack_lo[BRUSH_STROKE_STACK_ROWS];
+  int stack_hi[BRUSH_STROKE_STACK_ROWS];
+  int *lo = stack_lo;
+  int *hi = stack_hi;
+  if (rows > BRUSH_STROKE_STACK_ROWS) {
+    lo = (int *)malloc(sizeof(int) * rows);
+    hi = (int *)malloc(sizeof(int) * rows);
+    if (!lo || !hi) {
+      free(lo);
+      free(hi);
+      stroke_stamped(fb, mask, &path, color, coverage);
+      return;
     }
-    if (e2 <= dx) {
-      err += dx;
-      y0 += sy;
+  }
+  for (int i = 0; i < rows; i++) {
+    lo[i] = INT_MAX;
+    hi[i] = INT_MIN;
+  }
+
+  int run_y = path.y;
+  int run_a = path.x;
+  int run_b = path.x;
+  do {
+    if (path.y != run_y) {
+      sweep_run(mask, run_a, run_b, run_y, top, rows, lo, hi);
+      run_y = path.y;
+      run_a = path.x;
+      run_b = path.x;
+    } else if (path.x < run_a) {
+      run_a = path.x;
+    } else if (path.x > run_b) {
+      run_b = path.x;
     }
+  } while (fb_line_next(&path));
+  sweep_run(mask, run_a, run_b, run_y, top, rows, lo, hi);
+
+  for (int i = 0; i < rows; i++) {
+    if (lo[i] <= hi[i])
+      paint_span(fb, coverage, lo[i], hi[i], top + i, color);
+  }
+
+  if (lo != stack_lo) {
+    free(lo);
+    free(hi);
   }
 }
+
+void brush_stamp_circle(Framebuffer *fb, int cx, int cy, int radius,
+                        uint32_t color) {
+  fb_fill_circle(fb, cx, cy, radius, color);
+}
+
+void brush_stroke_circle(Framebuffer *fb, int x0, int y0, int x1, int y1,
+                         int radius, uint32_t color) {
+  if (radius > BRUSH_MAX_RADIUS) {
+    FbLine path;
+    if (!fb_line_clip(&path, x0, y0, x1, y1, -radius, -radius,
+                      fb->width - 1 + radius, fb->height - 1 + radius))
+      return;
+    do {
+      brush_stamp_circle(fb, path.x, path.y, radius, color);
+    } while (fb_line_next(&path));
+    return;
+  }
+
+  BrushMask mask;
+  mask.radius = radius < 0 ? 0 : radius;
+  mask_build_round(&mask, mask.radius);
+  mask.built = 1;
+  brush_stroke(fb, &mask, x0, y0, x1, y1, color, NULL);
+}
@@ -3,6 +3,65 @@
 #include "framebuffer.h"
 #include <stdint.h>
 
+#define BRUSH_MAX_RADIUS 64
+
+// Strokes touching at most this many rows keep their per-row extents on the
+// stack; taller ones allocate.
+#define BRUSH_STROKE_STACK_ROWS 512
+
+typedef enum { BRUSH_SHAPE_ROUND = 0, BRUSH_SHAPE_COUNT } BrushShape;
+
+// One row of a brush footprint, as offsets from the brush center.
+typedef struct {
+  int16_t x0;
+  int16_t x1;
+} BrushSpan;
+
+// Footprint of a brush as one span per row, top row first. Row i lies at
+// dy = i - radius.
+typedef struct {
+  int radius;
+  int built;
+  BrushSpan spans[2 * BRUSH_MAX_RADIUS + 1];
+} BrushMask;
+
+// Masks are built on first use for each shape/radius pair and kept for the
+// lifetime of the cache; `current` is what strokes are stamped with.
+typedef struct {
+  BrushMask masks[BRUSH_SHAPE_COUNT][BRUSH_MAX_RADIUS + 1];
+  const BrushMask *current;
+} BrushCache;
+
+// Pixels the current stroke has painted, one bit each, in FB_TILE_SIZE square
+// blocks allocated as the stroke reaches them; a block row is one word.
+// Painting through it writes every pixel at most once per stroke, so the
+// joints between segments and repeated points don't blend twice.
+typedef struct {
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  uint64_t **tiles;
+} BrushCoverage;
+
+void brush_cache_init(BrushCache *cache);
+const BrushMask *brush_cache_get(BrushCache *cache, BrushShape shape,
+                                 int radius);
+const BrushMask *brush_cache_select(BrushCache *cache, BrushShape shape,
+                                    int radius);
+
+void brush_coverage_init(BrushCoverage *cov);
+void brush_coverage_destroy(BrushCoverage *cov);
+// Forgets the previous stroke and sizes the coverage for a width x height
+// canvas. Returns 0 if out of memory; strokes then paint untracked.
+int brush_coverage_begin(BrushCoverage *cov, int width, int height);
+
+// `coverage` may be NULL to paint every pixel under the brush.
+void brush_stamp(Framebuffer *fb, const BrushMask *mask, int cx, int cy,
+                 uint32_t color, BrushCoverage *coverage);
+void brush_stroke(Framebuffer *fb, const BrushMask *mask, int x0, int y0,
+                  int x1, int y1, uint32_t color, BrushCoverage *coverage);
+
 void brush_stamp_circle(Framebuffer *fb, int cx, int cy, int radius,
                         uint32_t color);
 void brush_stroke_circle(Framebuffer *fb, int x0, int y0, int x1, int y1,
@@ -0,0 +1,312 @@
+#include "canvas_texture.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int rect_empty(const FbRect *r) {
+  return r->w <= 0 || r->h <= 0;
+}
+
+static void rect_union(FbRect *acc, const FbRect *r) {
+  if (rect_empty(r))
+    return;
+  if (rect_empty(acc)) {
+    *acc = *r;
+    return;
+  }
+  int left = acc->x < r->x ? acc->x : r->x;
+  int top = acc->y < r->y ? acc->y : r->y;
+  int right = acc->x + acc->w > r->x + r->w ? acc->x + acc->w : r->x + r->w;
+  int bottom = acc->y + acc->h > r->y + r->h ? acc->y + acc->h : r->y + r->h;
+  acc->x = left;
+  acc->y = top;
+  acc->w = right - left;
+  acc->h = bottom - top;
+}
+
+static FbRect rect_intersect(const FbRect *a, const FbRect *b) {
+  FbRect r;
+  r.x = a->x > b->x ? a->x : b->x;
+  r.y = a->y > b->y ? a->y : b->y;
+  int right = a->x + a->w < b->x + b->w ? a->x + a->w : b->x + b->w;
+  int bottom = a->y + a->h < b->y + b->h ? a->y + a->h : b->y + b->h;
+  r.w = right > r.x ? right - r.x : 0;
+  r.h = bottom > r.y ? bottom - r.y : 0;
+  return r;
+}
+
+static FbRect cell_rect(const CanvasLevel *lv, int cx, int cy) {
+  FbRect r = {cx * CANVAS_TEXTURE_CELL, cy * CANVAS_TEXTURE_CELL,
+              CANVAS_TEXTURE_CELL, CANVAS_TEXTURE_CELL};
+  if (r.x + r.w > lv->width)
+    r.w = lv->width - r.x;
+  if (r.y + r.h > lv->height)
+    r.h = lv->height - r.y;
+  return r;
+}
+
+static int level_init(CanvasLevel *lv, int level, int w, int h) {
+  lv->width = w;
+  lv->height = h;
+  lv->cells_x = (w + CANVAS_TEXTURE_CELL - 1) / CANVAS_TEXTURE_CELL;
+  lv->cells_y = (h + CANVAS_TEXTURE_CELL - 1) / CANVAS_TEXTURE_CELL;
+  lv->cells = (CanvasCell *)calloc((size_t)lv->cells_x * lv->cells_y,
+                                   sizeof(CanvasCell));
+  if (!lv->cells)
+    return 0;
+  if (level > 0) {
+    lv->pending.w = w;
+    lv->pending.h = h;
+  }
+  return 1;
+}
+
+// Allocates the reduced copy of a level the first time it is needed; it is
+// then built in full from the level below.
+static int level_mip(CanvasLevel *lv) {
+  if (lv->mip.pixels)
+    return 1;
+  if (!fb_init(&lv->mip, lv->width, lv->height))
+    return 0;
+  lv->pending.x = 0;
+  lv->pending.y = 0;
+  lv->pending.w = lv->width;
+  lv->pending.h = lv->height;
+  return 1;
+}
+
+static void level_destroy(CanvasLevel *lv) {
+  for (int i = 0; lv->cells && i < lv->cells_x * lv->cells_y; i++) {
+    if (lv->cells[i].texture)
+      SDL_DestroyTexture(lv->cells[i].texture);
+  }
+  free(lv->cells);
+  fb_destroy(&lv->mip);
+  memset(lv, 0, sizeof(*lv));
+}
+
+int canvas_texture_init(CanvasTexture *ct, SDL_Renderer *r, int w, int h) {
+  memset(ct, 0, sizeof(*ct));
+  ct->renderer = r;
+  if (!level_init(&ct->levels[0], 0, w, h))
+    return 0;
+  ct->level_count = 1;
+
+  // Reduced levels only get their pixels once they are displayed.
+  while (ct->level_count < CANVAS_TEXTURE_LEVELS && (w > 1 || h > 1)) {
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+    if (!level_init(&ct->levels[ct->level_count], ct->level_count, w, h))
+      break;
+    ct->level_count++;
+  }
+  return 1;
+}
+
+void canvas_texture_destroy(CanvasTexture *ct) {
+  if (!ct)
+    return;
+  for (int i = 0; i < ct->level_count; i++) {
+    level_destroy(&ct->levels[i]);
+  }
+  memset(ct, 0, sizeof(*ct));
+}
+
+int canvas_texture_pick_level(CanvasTexture *ct, float zoom) {
+  int level = 0;
+  while (level + 1 < ct->level_count && zoom * (float)(2 << level) <= 1.0f &&
+         level_mip(&ct->levels[level + 1]))
+    level++;
+  return level;
+}
+
+// Reads `count` colors of row y from x on, repeating the last pixel of the
+// row where the range runs past it.
+static void read_row(const Framebuffer *fb, int x, int y, int count,
+                     uint32_t *dst) {
+  int n = fb->width - x < count ? fb->width - x : count;
+  if (fb->indices)
+    span_expand(dst, fb->indices + (size_t)y * fb->width + x, n,
+                fb->palette);
+  else
+    fb_read_rect(fb, x, y, n, 1, dst, n);
+  for (int i = n; i < count; i++) {
+    dst[i] = dst[n - 1];
+  }
+}
+
+// Copies canvas area `d` into the texture of the cell whose top left corner
+// is at (ox, oy).
+static void upload(SDL_Texture *texture, const Framebuffer *fb, FbRect d,
+                   int ox, int oy) {
+  SDL_Rect rect = {d.x - ox, d.y - oy, d.w, d.h};
+  void *dst;
+  int pitch;
+  if (fb->indices) {
+    if (SDL_LockTexture(texture, &rect, &dst, &pitch) != 0)
+      return;
+    for (int row = 0; row < d.h; row++) {
+      span_expand((uint32_t *)((uint8_t *)dst + (size_t)row * pitch),
+                  fb->indices + (size_t)(d.y + row) * fb->width + d.x, d.w,
+                  fb->palette);
+    }
+    SDL_UnlockTexture(texture);
+    return;
+  }
+  if (fb->pixels) {
+    SDL_UpdateTexture(texture, &rect,
+                      fb->pixels + (size_t)d.y * fb->width + d.x,
+                      fb->width * (int)sizeof(uint32_t));
+    return;
+  }
+
+  if (SDL_LockTexture(texture, &rect, &dst, &pitch) != 0)
+    return;
+  fb_read_rect(fb, d.x, d.y, d.w, d.h, (uint32_t *)dst,
+               pitch / (int)sizeof(uint32_t));
+  SDL_UnlockTexture(texture);
+}
+
+// Gives a cell its texture the first time it is needed. Returns 0 if the
+// renderer is out of texture memory; the cell is then tried again later.
+static int cell_texture(CanvasTexture *ct, CanvasCell *cell, FbRect area) {
+  if (cell->texture)
+    return 1;
+  cell->texture = SDL_CreateTexture(ct->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                    SDL_TEXTUREACCESS_STREAMING, area.w,
+                                    area.h);
+  if (!cell->texture)
+    return 0;
+  // Canvas pixels are premultiplied. Renderers without custom blend modes
+  // copy them unblended instead, which is exact wherever the canvas is
+  // opaque.
+  SDL_BlendMode premultiplied = SDL_ComposeCustomBlendMode(
+      SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+      SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE,
+      SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+  if (SDL_SetTextureBlendMode(cell->texture, premultiplied) != 0)
+    SDL_SetTextureBlendMode(cell->texture, SDL_BLENDMODE_NONE);
+  cell->stale = area;
+  return 1;
+}
+
+// Records that area `d` of a level changed. Cells without a texture are
+// uploaded in full once they get one.
+static void mark_cells(CanvasLevel *lv, const FbRect *d) {
+  for (int cy = d->y / CANVAS_TEXTURE_CELL;
+       cy <= (d->y + d->h - 1) / CANVAS_TEXTURE_CELL; cy++) {
+    for (int cx = d->x / CANVAS_TEXTURE_CELL;
+         cx <= (d->x + d->w - 1) / CANVAS_TEXTURE_CELL; cx++) {
+      CanvasCell *cell = &lv->cells[cy * lv->cells_x + cx];
+      if (!cell->texture)
+        continue;
+      FbRect area = cell_rect(lv, cx, cy);
+      FbRect part = rect_intersect(d, &area);
+      rect_union(&cell->stale, &part);
+    }
+  }
+}
+
+// Recomputes the pending part of `level` from the level below, which must be
+// up to date there. Each texel averages a 2x2 block, with the last row and
+// column of an odd-sized level below repeated.
+static int rebuild(CanvasTexture *ct, const Framebuffer *fb, int level) {
+  CanvasLevel *lv = &ct->levels[level];
+  FbRect p = lv->pending;
+  if (!lv->mip.pixels)
+    return 0;
+  if (rect_empty(&p))
+    return 1;
+  const CanvasLevel *below = &ct->levels[level - 1];
+  const Framebuffer *src = level == 1 ? fb : &below->mip;
+
+  int n = 2 * p.w;
+  uint32_t *rows = (uint32_t *)malloc(sizeof(uint32_t) * 2 * n);
+  if (!rows)
+    return 0;
+  for (int y = p.y; y < p.y + p.h; y++) {
+    int y0 = 2 * y;
+    int y1 = y0 + 1 < below->height ? y0 + 1 : y0;
+    read_row(src, 2 * p.x, y0, n, rows);
+    read_row(src, 2 * p.x, y1, n, rows + n);
+    span_downsample(lv->mip.pixels + (size_t)y * lv->width + p.x, rows,
+                    rows + n, p.w);
+  }
+  free(rows);
+
+  mark_cells(lv, &p);
+  memset(&lv->pending, 0, sizeof(lv->pending));
+  return 1;
+}
+
+void canvas_texture_update(CanvasTexture *ct, Framebuffer *fb, int level,
+                           FbRect visible) {
+  FbRect d;
+  if (fb_take_dirty(fb, &d)) {
+    mark_cells(&ct->levels[0], &d);
+    for (int i = 1; i < ct->level_count; i++) {
+      FbRect r;
+      r.x = d.x >> i;
+      r.y = d.y >> i;
+      r.w = ((d.x + d.w - 1) >> i) - r.x + 1;
+      r.h = ((d.y + d.h - 1) >> i) - r.y + 1;
+      rect_union(&ct->levels[i].pending, &r);
+    }
+  }
+
+  if (level < 0 || level >= ct->level_count || rect_empty(&visible))
+    return;
+  for (int i = 1; i <= level; i++) {
+    if (!rebuild(ct, fb, i))
+      return;
+  }
+
+  CanvasLevel *lv = &ct->levels[level];
+  const Framebuffer *src = level == 0 ? fb : &lv->mip;
+  for (int cy = visible.y / CANVAS_TEXTURE_CELL;
+       cy <= (visible.y + visible.h - 1) / CANVAS_TEXTURE_CELL; cy++) {
+    for (int cx = visible.x / CANVAS_TEXTURE_CELL;
+         cx <= (visible.x + visible.w - 1) / CANVAS_TEXTURE_CELL; cx++) {
+      // Whole cells go up even if only partly visible, so a slow pan does
+      // not upload the same cell in slivers.
+      CanvasCell *cell = &lv->cells[cy * lv->cells_x + cx];
+      FbRect area = cell_rect(lv, cx, cy);
+      if (!cell_texture(ct, cell, area) || rect_empty(&cell->stale))
+        continue;
+      upload(cell->texture, src, cell->stale, area.x, area.y);
+      memset(&cell->stale, 0, sizeof(cell->stale));
+    }
+  }
+}
+
+// Screen position of column (or row) `c` when [s0, s0 + sn) maps to screen
+// [d0, d0 + dn). Adjacent cells compute their shared edge the same way, so
+// they meet without gaps or overlap.
+static int map_edge(int c, int s0, int sn, int d0, int dn) {
+  return d0 + (int)((int64_t)(c - s0) * dn / sn);
+}
+
+void canvas_texture_render(const CanvasTexture *ct, int level, FbRect src,
+                           const SDL_Rect *dst) {
+  if (level < 0 || level >= ct->level_count || rect_empty(&src))
+    return;
+  const CanvasLevel *lv = &ct->levels[level];
+  for (int cy = src.y / CANVAS_TEXTURE_CELL;
+       cy <= (src.y + src.h - 1) / CANVAS_TEXTURE_CELL; cy++) {
+    for (int cx = src.x / CANVAS_TEXTURE_CELL;
+         cx <= (src.x + src.w - 1) / CANVAS_TEXTURE_CELL; cx++) {
+      const CanvasCell *cell = &lv->cells[cy * lv->cells_x + cx];
+      if (!cell->texture)
+        continue;
+      FbRect area = cell_rect(lv, cx, cy);
+      FbRect part = rect_intersect(&src, &area);
+      SDL_Rect s = {part.x - area.x, part.y - area.y, part.w, part.h};
+      SDL_Rect d;
+      d.x = map_edge(part.x, src.x, src.w, dst->x, dst->w);
+      d.y = map_edge(part.y, src.y, src.h, dst->y, dst->h);
+      d.w = map_edge(part.x + part.w, src.x, src.w, dst->x, dst->w) - d.x;
+      d.h = map_edge(part.y + part.h, src.y, src.h, dst->y, dst->h) - d.y;
+      SDL_RenderCopy(ct->renderer, cell->texture, &s, &d);
+    }
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <SDL2/SDL.h>
+
+// Side of the square cells the canvas is split into, one texture each. Small
+// enough for any renderer's texture size limit.
+#define CANVAS_TEXTURE_CELL 512
+
+// The full-size canvas plus up to this many halvings, down to 1/16 scale.
+#define CANVAS_TEXTURE_LEVELS 5
+
+typedef struct {
+  SDL_Texture *texture; // created the first time the cell is visible
+  FbRect stale;         // area not uploaded yet
+} CanvasCell;
+
+typedef struct {
+  int width;
+  int height;
+  int cells_x;
+  int cells_y;
+  CanvasCell *cells;
+
+  // Levels above 0 only: the canvas box-filtered down 2^level times, and the
+  // part of it that no longer matches the level below. `mip` is allocated
+  // the first time the level is picked.
+  Framebuffer mip;
+  FbRect pending;
+} CanvasLevel;
+
+// The GPU copy of a canvas, as a grid of streaming textures. Writes are
+// collected per cell from the framebuffer's dirty rectangle and only
+// uploaded once the cell is on screen, so zoomed-in work on a large canvas
+// transfers just the part in view and no canvas is too big for the GPU.
+//
+// Zoomed out, a reduced copy from a mip pyramid is shown instead, which
+// looks smoother and uploads a quarter as much per level. Levels are kept
+// on the CPU, allocated when first displayed and only brought up to date
+// while they are.
+typedef struct {
+  SDL_Renderer *renderer;
+  int level_count;
+  CanvasLevel levels[CANVAS_TEXTURE_LEVELS];
+} CanvasTexture;
+
+// Sets up the cell grids for a w x h canvas. Textures are created on demand.
+int canvas_texture_init(CanvasTexture *ct, SDL_Renderer *r, int w, int h);
+void canvas_texture_destroy(CanvasTexture *ct);
+
+// The smallest level that still has at least one texel per screen pixel at
+// `zoom`. Level n is 2^n times smaller than the canvas. Allocates the
+// levels it needs on first use; if memory is short a larger level is
+// returned instead.
+int canvas_texture_pick_level(CanvasTexture *ct, float zoom);
+
+// Takes everything written to `fb` since the previous call and uploads what
+// is pending of `level` inside `visible`, given in that level's pixels. The
+// rest waits until it is displayed.
+void canvas_texture_update(CanvasTexture *ct, Framebuffer *fb, int level,
+                           FbRect visible);
+
+// Draws area `src` of `level` into the screen rectangle `dst`, one copy per
+// visible cell.
+void canvas_texture_render(const CanvasTexture *ct, int level, FbRect src,
+                           const SDL_Rect *dst);
@@ -1,20 +1,86 @@
 #include "export.h"
 
 #include <SDL2/SDL.h>
+#include <stdlib.h>
+
+static int has_translucent_pixels(const Framebuffer *fb) {
+  size_t count = (size_t)fb->width * fb->height;
+  for (size_t i = 0; i < count; i++) {
+    if ((fb->pixels[i] >> 24) != 255)
+      return 1;
+  }
+  return 0;
+}
+
+static void unpremultiply(uint32_t *pixels, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    pixels[i] = fb_unpremultiply(pixels[i]);
+  }
+}
+
+// Indexed canvases are saved as 8-bit BMPs carrying their palette, a quarter
+// of the size of a 32-bit export.
+static int export_bmp_indexed(const Framebuffer *fb, const char *path) {
+  if (!fb->palette)
+    return 0;
+
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(
+      (void *)fb->indices, fb->width, fb->height, 8, fb->width,
+      SDL_PIXELFORMAT_INDEX8);
+  if (!surface)
+    return 0;
+
+  SDL_Color colors[FB_PALETTE_SIZE];
+  for (int i = 0; i < FB_PALETTE_SIZE; i++) {
+    uint32_t c = fb->palette[i];
+    unpremultiply(&c, 1);
+    colors[i].r = (Uint8)(c >> 16);
+    colors[i].g = (Uint8)(c >> 8);
+    colors[i].b = (Uint8)c;
+    colors[i].a = (Uint8)(c >> 24);
+  }
+
+  int ok = SDL_SetPaletteColors(surface->format->palette, colors, 0,
+                                FB_PALETTE_SIZE) == 0 &&
+           SDL_SaveBMP(surface, path) == 0;
+  SDL_FreeSurface(surface);
+  return ok;
+}
 
 int export_bmp(const Framebuffer *fb, const char *path) {
-  if (!fb || !fb->pixels || fb->width <= 0 || fb->height <= 0)
+  if (!fb || fb->width <= 0 || fb->height <= 0)
+    return 0;
+  if (fb_is_indexed(fb))
+    return export_bmp_indexed(fb, path);
+  if (!fb->pixels && !fb_is_tiled(fb))
     return 0;
 
   const int pitch = fb->width * (int)sizeof(uint32_t);
 
+  // Canvas pixels are premultiplied, BMP alpha is straight. Partly
+  // transparent pixels (left by the erase mode) and tiled framebuffers, which
+  // have no linear pixel array, go through a temporary copy.
+  uint32_t *pixels = fb->pixels;
+  if (!pixels || has_translucent_pixels(fb)) {
+    pixels = (uint32_t *)malloc((size_t)pitch * fb->height);
+    if (!pixels)
+      return 0;
+    fb_read_rect(fb, 0, 0, fb->width, fb->height, pixels, fb->width);
+    unpremultiply(pixels, (size_t)fb->width * fb->height);
+  }
+
   SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(
-      (void *)fb->pixels, fb->width, fb->height, 32, pitch,
+      (void *)pixels, fb->width, fb->height, 32, pitch,
       SDL_PIXELFORMAT_ARGB8888);
-  if (!surface)
+  if (!surface) {
+    if (pixels != fb->pixels)
+      free(pixels);
     return 0;
+  }
 
   int ok = (SDL_SaveBMP(surface, path) == 0) ? 1 : 0;
   SDL_FreeSurface(surface);
+  if (pixels != fb->pixels)
+    free(pixels);
   return ok;
 }
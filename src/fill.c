@@ -0,0 +1,273 @@
+#include "fill.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Row `y` still has to be searched for region pixels under (or over) the
+// span [x0, x1] of row y - dy, which is already part of the region.
+typedef struct {
+  int x0;
+  int x1;
+  int y;
+  int dy;
+} FillSeed;
+
+typedef struct {
+  const Framebuffer *fb;
+  uint32_t target;
+  int tolerance;
+  uint64_t lo; // per-channel match bounds, spread()
+  uint64_t hi;
+
+  uint64_t *mask;    // one bit per pixel, set once it joins the region
+  size_t mask_pitch; // in words
+  int left;          // bounds of the region traced so far
+  int top;
+  int right;
+  int bottom;
+
+  FillSeed *stack;
+  int count;
+  int capacity;
+} Fill;
+
+// Spreads the four channels of a pixel into 16-bit lanes.
+static uint64_t spread(uint32_t p) {
+  return (p & 0x00FF00FFu) | ((uint64_t)(p & 0xFF00FF00u) << 24);
+}
+
+static int matches(const Fill *f, uint32_t p) {
+  if (f->tolerance == 0)
+    return p == f->target;
+  // Every lane is in [lo, hi] when neither subtraction borrows out of it.
+  const uint64_t top = 0x8000800080008000ull;
+  uint64_t x = spread(p);
+  return (((x | top) - f->lo) & ((f->hi | top) - x) & top) == top;
+}
+
+// Indexed pixels are compared by index, or by palette color when there is a
+// tolerance.
+static uint32_t index_value(const Fill *f, uint8_t index) {
+  return f->tolerance ? f->fb->palette[index] : index;
+}
+
+// Returns the first x' in [x, limit) of row y for which matches() differs
+// from `want`, or `limit`.
+static int match_run(const Fill *f, int x, int limit, int y, int want) {
+  if (f->fb->indices) {
+    const uint8_t *p = f->fb->indices + (size_t)y * f->fb->width;
+    for (; x < limit; x++) {
+      if (matches(f, index_value(f, p[x])) != want)
+        return x;
+    }
+    return limit;
+  }
+
+  while (x < limit) {
+    int run;
+    const uint32_t *p = fb_peek_run(f->fb, x, y, &run);
+    if (run > limit - x)
+      run = limit - x;
+    int i = 0;
+    if (want) {
+      // Inside a region whole blocks match; test them without branching on
+      // each pixel so the compiler can vectorize the check.
+      for (; i + 8 <= run; i += 8) {
+        int all = 1;
+        for (int k = 0; k < 8; k++)
+          all &= matches(f, p[i + k]);
+        if (!all)
+          break;
+      }
+    }
+    for (; i < run; i++) {
+      if (matches(f, p[i]) != want)
+        return x + i;
+    }
+    x += run;
+  }
+  return limit;
+}
+
+static const uint64_t *mask_row(const Fill *f, int y) {
+  return f->mask + (size_t)y * f->mask_pitch;
+}
+
+// Returns the first x' in [x, limit) whose mask bit equals `set`, or `limit`.
+static int find_bit(const uint64_t *row, int x, int limit, int set) {
+  uint64_t flip = set ? 0 : ~(uint64_t)0;
+  while (x < limit) {
+    uint64_t word = (row[x >> 6] ^ flip) >> (x & 63);
+    if (word) {
+      x += __builtin_ctzll(word);
+      return x < limit ? x : limit;
+    }
+    x = (x | 63) + 1;
+  }
+  return limit;
+}
+
+// Pixels still to be added to the region match the seed and are not in the
+// mask yet. Returns the first x' in [x, limit) that is not one, or `limit`.
+static int inside_run(const Fill *f, int x, int limit, int y) {
+  return match_run(f, x, find_bit(mask_row(f, y), x, limit, 1), y, 1);
+}
+
+// Returns the first x' in [x, limit) that is still to be added, or `limit`.
+static int outside_run(const Fill *f, int x, int limit, int y) {
+  const uint64_t *row = mask_row(f, y);
+  while (x < limit) {
+    x = find_bit(row, x, limit, 0);
+    int end = find_bit(row, x, limit, 1);
+    int found = match_run(f, x, end, y, 0);
+    if (found < end)
+      return found;
+    x = end;
+  }
+  return limit;
+}
+
+// Returns the smallest x' <= x for which all of [x', x) is still to be added.
+static int scan_left(const Fill *f, int x, int y) {
+  const uint64_t *row = mask_row(f, y);
+  if (f->fb->indices) {
+    const uint8_t *p = f->fb->indices + (size_t)y * f->fb->width;
+    while (x > 0 && !((row[(x - 1) >> 6] >> ((x - 1) & 63)) & 1) &&
+           matches(f, index_value(f, p[x - 1])))
+      x--;
+    return x;
+  }
+
+  while (x > 0) {
+    int start = (x - 1) & ~FB_TILE_MASK;
+    int run;
+    const uint32_t *p = fb_peek_run(f->fb, start, y, &run);
+    for (int i = x - 1; i >= start; i--) {
+      if (((row[i >> 6] >> (i & 63)) & 1) || !matches(f, p[i - start]))
+        return i + 1;
+    }
+    x = start;
+  }
+  return 0;
+}
+
+static void mask_span(Fill *f, int x0, int x1, int y) {
+  uint64_t *row = f->mask + (size_t)y * f->mask_pitch;
+  for (int w = x0 >> 6; w <= x1 >> 6; w++) {
+    uint64_t bits = ~(uint64_t)0;
+    if (w == x0 >> 6)
+      bits &= ~(uint64_t)0 << (x0 & 63);
+    if (w == x1 >> 6)
+      bits &= ~(uint64_t)0 >> (63 - (x1 & 63));
+    row[w] |= bits;
+  }
+
+  if (x0 < f->left)
+    f->left = x0;
+  if (x1 > f->right)
+    f->right = x1;
+  if (y < f->top)
+    f->top = y;
+  if (y > f->bottom)
+    f->bottom = y;
+}
+
+static int push(Fill *f, int x0, int x1, int y, int dy) {
+  if (y < 0 || y >= f->fb->height)
+    return 1;
+  if (f->count == f->capacity) {
+    int capacity = f->capacity ? f->capacity * 2 : 256;
+    FillSeed *stack =
+        (FillSeed *)realloc(f->stack, sizeof(FillSeed) * capacity);
+    if (!stack)
+      return 0;
+    f->stack = stack;
+    f->capacity = capacity;
+  }
+  FillSeed *s = &f->stack[f->count++];
+  s->x0 = x0;
+  s->x1 = x1;
+  s->y = y;
+  s->dy = dy;
+  return 1;
+}
+
+// Marks the whole region in the mask. Every span found is a full run of
+// region pixels; the rows on both sides are searched below and above it,
+// but on the side it was found from only where it sticks out past its
+// parent span, since the rest of that row is already known.
+static int trace(Fill *f, int x, int y) {
+  if (!push(f, x, x, y - 1, -1) || !push(f, x, x, y, 1))
+    return 0;
+
+  int width = f->fb->width;
+  while (f->count > 0) {
+    FillSeed s = f->stack[--f->count];
+    int px = outside_run(f, s.x0, s.x1 + 1, s.y);
+    while (px <= s.x1) {
+      int x0 = scan_left(f, px, s.y);
+      int x1 = inside_run(f, px + 1, width, s.y) - 1;
+      mask_span(f, x0, x1, s.y);
+
+      if (!push(f, x0, x1, s.y + s.dy, s.dy))
+        return 0;
+      if (x0 < s.x0 && !push(f, x0, s.x0 - 1, s.y - s.dy, -s.dy))
+        return 0;
+      if (x1 > s.x1 && !push(f, s.x1 + 1, x1, s.y - s.dy, -s.dy))
+        return 0;
+
+      px = outside_run(f, x1 + 2, s.x1 + 1, s.y);
+    }
+  }
+  return 1;
+}
+
+static void paint(const Fill *f, Framebuffer *fb, uint32_t color) {
+  int limit = f->right + 1;
+  for (int y = f->top; y <= f->bottom; y++) {
+    const uint64_t *row = mask_row(f, y);
+    int x = find_bit(row, f->left, limit, 1);
+    while (x < limit) {
+      int end = find_bit(row, x, limit, 0);
+      fb_fill_span(fb, x, end - 1, y, color);
+      x = find_bit(row, end, limit, 1);
+    }
+  }
+}
+
+int fill_flood(Framebuffer *fb, int x, int y, uint32_t color, int tolerance) {
+  if (x < 0 || y < 0 || x >= fb->width || y >= fb->height)
+    return 0;
+
+  Fill f;
+  memset(&f, 0, sizeof(f));
+  f.fb = fb;
+  f.tolerance = tolerance < 0 ? 0 : tolerance;
+  if (fb->indices && !fb->palette)
+    f.tolerance = 0;
+  f.target = fb_get_pixel(fb, x, y, 0);
+  if (fb->indices)
+    f.target = index_value(&f, (uint8_t)f.target);
+  uint32_t lo = 0, hi = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int c = (int)((f.target >> shift) & 0xFF);
+    lo |= (uint32_t)(c - f.tolerance < 0 ? 0 : c - f.tolerance) << shift;
+    hi |= (uint32_t)(c + f.tolerance > 255 ? 255 : c + f.tolerance) << shift;
+  }
+  f.lo = spread(lo);
+  f.hi = spread(hi);
+  f.mask_pitch = ((size_t)fb->width + 63) >> 6;
+  f.mask = (uint64_t *)calloc(f.mask_pitch * fb->height, sizeof(uint64_t));
+  if (!f.mask)
+    return 0;
+  f.left = f.right = x;
+  f.top = f.bottom = y;
+
+  int ok = trace(&f, x, y);
+  if (ok)
+    paint(&f, fb, color);
+
+  free(f.stack);
+  free(f.mask);
+  return ok;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <stdint.h>
+
+// Largest useful tolerance: the biggest per-channel difference there is.
+#define FILL_MAX_TOLERANCE 255
+
+// Bucket fill. Paints the 4-connected region around (x, y) whose pixels
+// differ from the seed pixel by at most `tolerance` in every channel of their
+// premultiplied ARGB value (0 matches the exact color only), combining with
+// the framebuffer's blend mode like any other primitive. Indexed framebuffers
+// match by index, or by palette color when there is a tolerance.
+//
+// The region is traced row span by row span from an explicit stack of parent
+// spans into a one-bit-per-pixel mask, and only painted once it is complete,
+// so memory stays at width * height / 8 bytes plus the span stack. Returns 0
+// and leaves the framebuffer untouched if the seed is outside it or memory
+// runs out.
+int fill_flood(Framebuffer *fb, int x, int y, uint32_t color, int tolerance);
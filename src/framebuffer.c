@@ -1,14 +1,29 @@
 #include "framebuffer.h"
 
+#include "span.h"
+
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
-static int iabs(int v) { return v < 0 ? -v : v; }
 static int imin(int a, int b) { return a < b ? a : b; }
 static int imax(int a, int b) { return a > b ? a : b; }
 
 int fb_init(Framebuffer *fb, int w, int h) {
   fb->width = w;
   fb->height = h;
+  fb->indices = NULL;
+  fb->palette = NULL;
+  fb->tiles = NULL;
+  fb->solid_tile = NULL;
+  fb->background = 0;
+  fb->tiles_x = (w + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->tiles_y = (h + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->touched = NULL;
+  fb->on_touch = NULL;
+  fb->touch_data = NULL;
+  fb->blend = SPAN_BLEND_REPLACE;
+  fb_mark_all_dirty(fb);
   fb->pixels = (uint32_t *)malloc(sizeof(uint32_t) * w * h);
   if (!fb->pixels)
     return 0;
@@ -16,58 +31,628 @@ int fb_init(Framebuffer *fb, int w, int h) {
   return 1;
 }
 
+int fb_init_tiled(Framebuffer *fb, int w, int h, uint32_t background) {
+  fb->width = w;
+  fb->height = h;
+  fb->pixels = NULL;
+  fb->indices = NULL;
+  fb->palette = NULL;
+  fb->background = background;
+  fb->tiles_x = (w + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->tiles_y = (h + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->touched = NULL;
+  fb->on_touch = NULL;
+  fb->touch_data = NULL;
+  fb->blend = SPAN_BLEND_REPLACE;
+  fb_mark_all_dirty(fb);
+
+  fb->solid_tile = (uint32_t *)malloc(sizeof(uint32_t) * FB_TILE_PIXELS);
+  fb->tiles = (uint32_t **)malloc(sizeof(uint32_t *) * fb->tiles_x *
+                                  fb->tiles_y);
+  if (!fb->solid_tile || !fb->tiles) {
+    free(fb->solid_tile);
+    free(fb->tiles);
+    fb->solid_tile = NULL;
+    fb->tiles = NULL;
+    return 0;
+  }
+
+  span_fill(fb->solid_tile, FB_TILE_PIXELS, background);
+  for (int i = 0; i < fb->tiles_x * fb->tiles_y; i++) {
+    fb->tiles[i] = fb->solid_tile;
+  }
+
+  return 1;
+}
+
+int fb_init_indexed(Framebuffer *fb, int w, int h, uint32_t *palette) {
+  fb->width = w;
+  fb->height = h;
+  fb->pixels = NULL;
+  fb->palette = palette;
+  fb->tiles = NULL;
+  fb->solid_tile = NULL;
+  fb->background = 0;
+  fb->tiles_x = (w + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->tiles_y = (h + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  fb->touched = NULL;
+  fb->on_touch = NULL;
+  fb->touch_data = NULL;
+  fb->blend = SPAN_BLEND_REPLACE;
+  fb_mark_all_dirty(fb);
+  fb->indices = (uint8_t *)malloc((size_t)w * h);
+  if (!fb->indices)
+    return 0;
+
+  return 1;
+}
+
+static void release_tiles(Framebuffer *fb) {
+  for (int i = 0; i < fb->tiles_x * fb->tiles_y; i++) {
+    if (fb->tiles[i] != fb->solid_tile)
+      free(fb->tiles[i]);
+    fb->tiles[i] = fb->solid_tile;
+  }
+}
+
 void fb_destroy(Framebuffer *fb) {
   if (!fb)
     return;
+  fb_track_end(fb);
+  if (fb->tiles) {
+    release_tiles(fb);
+    free(fb->tiles);
+    free(fb->solid_tile);
+  }
   free(fb->pixels);
+  free(fb->indices);
   fb->pixels = NULL;
+  fb->indices = NULL;
+  fb->palette = NULL;
+  fb->tiles = NULL;
+  fb->solid_tile = NULL;
   fb->width = 0;
   fb->height = 0;
+  fb->tiles_x = 0;
+  fb->tiles_y = 0;
 }
 
-void fb_clear(Framebuffer *fb, uint32_t color) {
-  int count = fb->width * fb->height;
+void fb_mark_dirty(Framebuffer *fb, int x0, int y0, int x1, int y1) {
+  int left = imax(imin(x0, x1), 0);
+  int top = imax(imin(y0, y1), 0);
+  int right = imin(imax(x0, x1), fb->width - 1);
+  int bottom = imin(imax(y0, y1), fb->height - 1);
+  if (left > right || top > bottom)
+    return;
+
+  FbRect *d = &fb->dirty;
+  if (d->w > 0 && d->h > 0) {
+    left = imin(left, d->x);
+    top = imin(top, d->y);
+    right = imax(right, d->x + d->w - 1);
+    bottom = imax(bottom, d->y + d->h - 1);
+  }
+  d->x = left;
+  d->y = top;
+  d->w = right - left + 1;
+  d->h = bottom - top + 1;
+}
+
+void fb_mark_all_dirty(Framebuffer *fb) {
+  fb->dirty.x = 0;
+  fb->dirty.y = 0;
+  fb->dirty.w = fb->width;
+  fb->dirty.h = fb->height;
+}
+
+int fb_take_dirty(Framebuffer *fb, FbRect *out) {
+  if (fb->dirty.w <= 0 || fb->dirty.h <= 0)
+    return 0;
+  *out = fb->dirty;
+  fb->dirty.w = 0;
+  fb->dirty.h = 0;
+  return 1;
+}
+
+int fb_track_begin(Framebuffer *fb, FbTouchFn on_touch, void *user_data) {
+  fb_track_end(fb);
+  fb->touched = (uint8_t *)calloc((size_t)fb->tiles_x * fb->tiles_y, 1);
+  if (!fb->touched)
+    return 0;
+  fb->on_touch = on_touch;
+  fb->touch_data = user_data;
+  return 1;
+}
+
+void fb_track_end(Framebuffer *fb) {
+  free(fb->touched);
+  fb->touched = NULL;
+  fb->on_touch = NULL;
+  fb->touch_data = NULL;
+}
+
+static void touch_tile(Framebuffer *fb, int tx, int ty) {
+  uint8_t *flag = &fb->touched[ty * fb->tiles_x + tx];
+  if (*flag)
+    return;
+  *flag = 1;
+  fb->on_touch(fb->touch_data, fb, tx, ty);
+}
+
+// Reports the tiles under an already clipped rectangle.
+static void touch_rect(Framebuffer *fb, int x0, int y0, int x1, int y1) {
+  if (!fb->touched)
+    return;
+  for (int ty = y0 >> FB_TILE_SHIFT; ty <= y1 >> FB_TILE_SHIFT; ty++) {
+    for (int tx = x0 >> FB_TILE_SHIFT; tx <= x1 >> FB_TILE_SHIFT; tx++) {
+      touch_tile(fb, tx, ty);
+    }
+  }
+}
+
+int fb_is_tiled(const Framebuffer *fb) { return fb->tiles != NULL; }
+
+int fb_is_indexed(const Framebuffer *fb) { return fb->indices != NULL; }
+
+size_t fb_memory_usage(const Framebuffer *fb) {
+  if (fb->indices)
+    return (size_t)fb->width * fb->height;
+  if (!fb->tiles)
+    return sizeof(uint32_t) * (size_t)fb->width * fb->height;
+
+  int count = fb->tiles_x * fb->tiles_y;
+  size_t bytes = sizeof(uint32_t *) * count + sizeof(uint32_t) * FB_TILE_PIXELS;
   for (int i = 0; i < count; i++) {
-    fb->pixels[i] = color;
+    if (fb->tiles[i] != fb->solid_tile)
+      bytes += sizeof(uint32_t) * FB_TILE_PIXELS;
   }
+  return bytes;
 }
 
-void fb_put_pixel(Framebuffer *fb, int x, int y, uint32_t color) {
+size_t fb_tile_bytes(const Framebuffer *fb) {
+  return (fb->indices ? 1 : sizeof(uint32_t)) * FB_TILE_PIXELS;
+}
+
+// Returns a writable tile, copying it off the shared background tile on first
+// write. Returns NULL if the allocation fails; the write is then dropped.
+static uint32_t *tile_for_write(Framebuffer *fb, int tx, int ty) {
+  uint32_t **slot = &fb->tiles[ty * fb->tiles_x + tx];
+  if (*slot != fb->solid_tile)
+    return *slot;
+
+  uint32_t *tile = (uint32_t *)malloc(sizeof(uint32_t) * FB_TILE_PIXELS);
+  if (!tile)
+    return NULL;
+  memcpy(tile, fb->solid_tile, sizeof(uint32_t) * FB_TILE_PIXELS);
+  *slot = tile;
+  return tile;
+}
+
+static const uint32_t *tile_for_read(const Framebuffer *fb, int tx, int ty) {
+  return fb->tiles[ty * fb->tiles_x + tx];
+}
+
+void fb_set_blend(Framebuffer *fb, SpanBlend mode) { fb->blend = mode; }
+
+uint32_t fb_premultiply(uint32_t argb) {
+  uint32_t a = argb >> 24;
+  uint32_t out = a << 24;
+  for (int shift = 0; shift < 24; shift += 8) {
+    uint32_t c = ((argb >> shift) & 255) * a + 128;
+    out |= ((c + (c >> 8)) >> 8) << shift;
+  }
+  return out;
+}
+
+uint32_t fb_unpremultiply(uint32_t argb) {
+  uint32_t a = argb >> 24;
+  if (a == 255 || a == 0)
+    return argb;
+  uint32_t out = a << 24;
+  for (int shift = 0; shift < 24; shift += 8) {
+    uint32_t c = (((argb >> shift) & 255) * 255 + a / 2) / a;
+    out |= (c > 255 ? 255 : c) << shift;
+  }
+  return out;
+}
+
+// Whether painting `color` leaves exactly `color` behind, so runs can be
+// stored or shared tiles reused without reading the destination.
+static int overwrites(const Framebuffer *fb, uint32_t color) {
+  return fb->blend == SPAN_BLEND_REPLACE ||
+         (fb->blend == SPAN_BLEND_OVER && (color >> 24) == 255);
+}
+
+void fb_clear(Framebuffer *fb, uint32_t color) {
+  fb_mark_all_dirty(fb);
+  touch_rect(fb, 0, 0, fb->width - 1, fb->height - 1);
+  if (fb->indices) {
+    memset(fb->indices, (int)(color & 0xFF), (size_t)fb->width * fb->height);
+    return;
+  }
+  if (fb->tiles) {
+    release_tiles(fb);
+    fb->background = color;
+    span_fill(fb->solid_tile, FB_TILE_PIXELS, color);
+    return;
+  }
+
+  span_fill(fb->pixels, fb->width * fb->height, color);
+}
+
+void fb_fill_span(Framebuffer *fb, int x0, int x1, int y, uint32_t color) {
+  if (y < 0 || y >= fb->height)
+    return;
+  x0 = imax(x0, 0);
+  x1 = imin(x1, fb->width - 1);
+  if (x0 > x1)
+    return;
+  fb_mark_dirty(fb, x0, y, x1, y);
+  touch_rect(fb, x0, y, x1, y);
+
+  if (fb->indices) {
+    memset(fb->indices + (size_t)y * fb->width + x0, (int)(color & 0xFF),
+           (size_t)(x1 - x0 + 1));
+    return;
+  }
+  if (!fb->tiles) {
+    span_blend(fb->pixels + (size_t)y * fb->width + x0, x1 - x0 + 1, color,
+               fb->blend);
+    return;
+  }
+
+  int ty = y >> FB_TILE_SHIFT;
+  int row = (y & FB_TILE_MASK) << FB_TILE_SHIFT;
+  int keep_solid = overwrites(fb, color) && color == fb->background;
+  while (x0 <= x1) {
+    int lx = x0 & FB_TILE_MASK;
+    int run = imin(FB_TILE_SIZE - lx, x1 - x0 + 1);
+    const uint32_t *cur = tile_for_read(fb, x0 >> FB_TILE_SHIFT, ty);
+    if (cur != fb->solid_tile || !keep_solid) {
+      uint32_t *tile = tile_for_write(fb, x0 >> FB_TILE_SHIFT, ty);
+      if (tile)
+        span_blend(tile + row + lx, run, color, fb->blend);
+    }
+    x0 += run;
+  }
+}
+
+// Stores one pixel the caller has already clipped to the framebuffer. Does
+// not grow the dirty rectangle.
+static void store_pixel(Framebuffer *fb, int x, int y, uint32_t color) {
+  if (fb->touched)
+    touch_tile(fb, x >> FB_TILE_SHIFT, y >> FB_TILE_SHIFT);
+  if (fb->indices) {
+    fb->indices[(size_t)y * fb->width + x] = (uint8_t)color;
+    return;
+  }
+
+  uint32_t *dst;
+  if (fb->tiles) {
+    uint32_t *tile = tile_for_write(fb, x >> FB_TILE_SHIFT, y >> FB_TILE_SHIFT);
+    if (!tile)
+      return;
+    dst = tile + ((y & FB_TILE_MASK) << FB_TILE_SHIFT) + (x & FB_TILE_MASK);
+  } else {
+    dst = fb->pixels + (size_t)y * fb->width + x;
+  }
+
+  if (fb->blend == SPAN_BLEND_REPLACE)
+    *dst = color;
+  else
+    span_blend(dst, 1, color, fb->blend);
+}
+
+static void plot(Framebuffer *fb, int x, int y, uint32_t color) {
   if (x < 0 || y < 0 || x >= fb->width || y >= fb->height)
     return;
+  store_pixel(fb, x, y, color);
+}
 
-  fb->pixels[y * fb->width + x] = color;
+void fb_put_pixel(Framebuffer *fb, int x, int y, uint32_t color) {
+  fb_mark_dirty(fb, x, y, x, y);
+  plot(fb, x, y, color);
 }
 
 uint32_t fb_get_pixel(const Framebuffer *fb, int x, int y, uint32_t fallback) {
   if (x < 0 || y < 0 || x >= fb->width || y >= fb->height)
     return fallback;
+
+  if (fb->indices)
+    return fb->indices[(size_t)y * fb->width + x];
+  if (fb->tiles) {
+    const uint32_t *tile =
+        tile_for_read(fb, x >> FB_TILE_SHIFT, y >> FB_TILE_SHIFT);
+    return tile[((y & FB_TILE_MASK) << FB_TILE_SHIFT) + (x & FB_TILE_MASK)];
+  }
+
   return fb->pixels[y * fb->width + x];
 }
 
-void fb_draw_line(Framebuffer *fb, int x0, int y0, int x1, int y1,
-                  uint32_t color) {
-  int dx = iabs(x1 - x0);
-  int sx = (x0 < x1) ? 1 : -1;
-  int dy = -iabs(y1 - y0);
-  int sy = (y0 < y1) ? 1 : -1;
-  int err = dx + dy;
+void fb_read_rect(const Framebuffer *fb, int x, int y, int w, int h,
+                  uint32_t *dst, int dst_pitch) {
+  if (fb->indices) {
+    for (int row = 0; row < h; row++) {
+      const uint8_t *in = fb->indices + (size_t)(y + row) * fb->width + x;
+      uint32_t *out = dst + (size_t)row * dst_pitch;
+      for (int i = 0; i < w; i++)
+        out[i] = in[i];
+    }
+    return;
+  }
+  if (!fb->tiles) {
+    for (int row = 0; row < h; row++) {
+      memcpy(dst + (size_t)row * dst_pitch,
+             fb->pixels + (size_t)(y + row) * fb->width + x,
+             sizeof(uint32_t) * w);
+    }
+    return;
+  }
 
-  for (;;) {
-    fb_put_pixel(fb, x0, y0, color);
-    if (x0 == x1 && y0 == y1)
-      break;
+  for (int row = 0; row < h; row++) {
+    int py = y + row;
+    int ty = py >> FB_TILE_SHIFT;
+    int ly = py & FB_TILE_MASK;
+    uint32_t *out = dst + (size_t)row * dst_pitch;
 
-    int e2 = 2 * err;
-    if (e2 >= dy) {
-      err += dy;
-      x0 += sx;
+    int px = x;
+    while (px < x + w) {
+      int lx = px & FB_TILE_MASK;
+      int run = imin(FB_TILE_SIZE - lx, x + w - px);
+      const uint32_t *tile = tile_for_read(fb, px >> FB_TILE_SHIFT, ty);
+      memcpy(out + (px - x), tile + (ly << FB_TILE_SHIFT) + lx,
+             sizeof(uint32_t) * run);
+      px += run;
     }
-    if (e2 <= dx) {
-      err += dx;
-      y0 += sy;
+  }
+}
+
+void fb_write_rect(Framebuffer *fb, int x, int y, int w, int h,
+                   const uint32_t *src, int src_pitch) {
+  if (w <= 0 || h <= 0)
+    return;
+  fb_mark_dirty(fb, x, y, x + w - 1, y + h - 1);
+  touch_rect(fb, x, y, x + w - 1, y + h - 1);
+  if (fb->indices) {
+    for (int row = 0; row < h; row++) {
+      const uint32_t *in = src + (size_t)row * src_pitch;
+      uint8_t *out = fb->indices + (size_t)(y + row) * fb->width + x;
+      for (int i = 0; i < w; i++)
+        out[i] = (uint8_t)in[i];
+    }
+    return;
+  }
+  if (!fb->tiles) {
+    for (int row = 0; row < h; row++) {
+      memcpy(fb->pixels + (size_t)(y + row) * fb->width + x,
+             src + (size_t)row * src_pitch, sizeof(uint32_t) * w);
     }
+    return;
   }
+
+  for (int row = 0; row < h; row++) {
+    int py = y + row;
+    int ty = py >> FB_TILE_SHIFT;
+    int ly = py & FB_TILE_MASK;
+    const uint32_t *in = src + (size_t)row * src_pitch;
+
+    int px = x;
+    while (px < x + w) {
+      int lx = px & FB_TILE_MASK;
+      int run = imin(FB_TILE_SIZE - lx, x + w - px);
+      uint32_t *tile = tile_for_write(fb, px >> FB_TILE_SHIFT, ty);
+      if (tile)
+        memcpy(tile + (ly << FB_TILE_SHIFT) + lx, in + (px - x),
+               sizeof(uint32_t) * run);
+      px += run;
+    }
+  }
+}
+
+const uint32_t *fb_peek_run(const Framebuffer *fb, int x, int y, int *run) {
+  if (!fb->tiles) {
+    *run = fb->width - x;
+    return fb->pixels + (size_t)y * fb->width + x;
+  }
+  const uint32_t *tile =
+      tile_for_read(fb, x >> FB_TILE_SHIFT, y >> FB_TILE_SHIFT);
+  int lx = x & FB_TILE_MASK;
+  *run = imin(FB_TILE_SIZE - lx, fb->width - x);
+  return tile + ((y & FB_TILE_MASK) << FB_TILE_SHIFT) + lx;
+}
+
+int fb_tile_is_shared(const Framebuffer *fb, int tx, int ty) {
+  return fb->tiles && fb->tiles[ty * fb->tiles_x + tx] == fb->solid_tile;
+}
+
+void fb_read_tile(const Framebuffer *fb, int tx, int ty, uint32_t *buffer) {
+  int x = tx << FB_TILE_SHIFT;
+  int y = ty << FB_TILE_SHIFT;
+  int w = imin(FB_TILE_SIZE, fb->width - x);
+  int h = imin(FB_TILE_SIZE, fb->height - y);
+  if (!fb->indices) {
+    fb_read_rect(fb, x, y, w, h, buffer, FB_TILE_SIZE);
+    return;
+  }
+
+  uint8_t *out = (uint8_t *)buffer;
+  for (int row = 0; row < h; row++) {
+    memcpy(out + row * FB_TILE_SIZE,
+           fb->indices + (size_t)(y + row) * fb->width + x, (size_t)w);
+  }
+}
+
+void fb_write_tile(Framebuffer *fb, int tx, int ty, const uint32_t *buffer) {
+  int x = tx << FB_TILE_SHIFT;
+  int y = ty << FB_TILE_SHIFT;
+  int w = imin(FB_TILE_SIZE, fb->width - x);
+  int h = imin(FB_TILE_SIZE, fb->height - y);
+  if (!fb->indices) {
+    fb_write_rect(fb, x, y, w, h, buffer, FB_TILE_SIZE);
+    return;
+  }
+
+  fb_mark_dirty(fb, x, y, x + w - 1, y + h - 1);
+  touch_rect(fb, x, y, x + w - 1, y + h - 1);
+  const uint8_t *in = (const uint8_t *)buffer;
+  for (int row = 0; row < h; row++) {
+    memcpy(fb->indices + (size_t)(y + row) * fb->width + x,
+           in + row * FB_TILE_SIZE, (size_t)w);
+  }
+}
+
+void fb_swap_tile(Framebuffer *fb, int tx, int ty, uint32_t **buffer) {
+  int x = tx << FB_TILE_SHIFT;
+  int y = ty << FB_TILE_SHIFT;
+  int w = imin(FB_TILE_SIZE, fb->width - x);
+  int h = imin(FB_TILE_SIZE, fb->height - y);
+  fb_mark_dirty(fb, x, y, x + w - 1, y + h - 1);
+  touch_rect(fb, x, y, x + w - 1, y + h - 1);
+
+  if (fb->indices) {
+    for (int row = 0; row < h; row++) {
+      uint8_t *a = (uint8_t *)*buffer + row * FB_TILE_SIZE;
+      uint8_t *b = fb->indices + (size_t)(y + row) * fb->width + x;
+      for (int i = 0; i < w; i++) {
+        uint8_t t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+      }
+    }
+    return;
+  }
+
+  uint32_t **slot = fb->tiles ? &fb->tiles[ty * fb->tiles_x + tx] : NULL;
+  if (slot && *slot != fb->solid_tile) {
+    uint32_t *old = *slot;
+    *slot = *buffer;
+    *buffer = old;
+    return;
+  }
+
+  // Flat storage, or the shared background tile that cannot be handed out:
+  // swap the contents row by row instead.
+  uint32_t *tile = slot ? tile_for_write(fb, tx, ty) : NULL;
+  if (slot && !tile)
+    return;
+  for (int row = 0; row < h; row++) {
+    uint32_t *a = *buffer + row * FB_TILE_SIZE;
+    uint32_t *b = tile ? tile + row * FB_TILE_SIZE
+                       : fb->pixels + (size_t)(y + row) * fb->width + x;
+    for (int i = 0; i < w; i++) {
+      uint32_t t = a[i];
+      a[i] = b[i];
+      b[i] = t;
+    }
+  }
+}
+
+static int64_t ceil_div64(int64_t a, int64_t b) { return (a + b - 1) / b; }
+
+// For a line walked along its major axis, the minor axis has taken
+// floor((2 * minor * k + major) / (2 * major)) steps after k major steps.
+// That is what the error term of the classic walk works out to, ties
+// included, so clipping only needs to invert it.
+int fb_line_clip(FbLine *line, int x0, int y0, int x1, int y1, int left,
+                 int top, int right, int bottom) {
+  int64_t dx = (int64_t)x1 - x0;
+  int64_t dy = (int64_t)y1 - y0;
+  int sx = dx < 0 ? -1 : 1;
+  int sy = dy < 0 ? -1 : 1;
+  dx = dx < 0 ? -dx : dx;
+  dy = dy < 0 ? -dy : dy;
+
+  int x_major = dx >= dy;
+  int64_t major = x_major ? dx : dy;
+  int64_t minor = x_major ? dy : dx;
+  int64_t a0 = x_major ? x0 : y0;
+  int64_t b0 = x_major ? y0 : x0;
+  int sa = x_major ? sx : sy;
+  int sb = x_major ? sy : sx;
+  int64_t a_min = x_major ? left : top;
+  int64_t a_max = x_major ? right : bottom;
+  int64_t b_min = x_major ? top : left;
+  int64_t b_max = x_major ? bottom : right;
+
+  // Steps k along the major axis that stay inside its bounds.
+  int64_t k_lo = sa > 0 ? a_min - a0 : a0 - a_max;
+  int64_t k_hi = sa > 0 ? a_max - a0 : a0 - a_min;
+  if (k_lo < 0)
+    k_lo = 0;
+  if (k_hi > major)
+    k_hi = major;
+
+  // Minor steps m that stay inside its bounds, turned into major steps.
+  int64_t m_lo = sb > 0 ? b_min - b0 : b0 - b_max;
+  int64_t m_hi = sb > 0 ? b_max - b0 : b0 - b_min;
+  if (m_hi < 0 || m_lo > minor)
+    return 0;
+  if (m_lo > 0) {
+    int64_t k = ceil_div64(major * (2 * m_lo - 1), 2 * minor);
+    if (k > k_lo)
+      k_lo = k;
+  }
+  if (m_hi < minor) {
+    int64_t k = ceil_div64(major * (2 * m_hi + 1), 2 * minor) - 1;
+    if (k < k_hi)
+      k_hi = k;
+  }
+  if (k_lo > k_hi)
+    return 0;
+
+  int64_t m = major ? (2 * minor * k_lo + major) / (2 * major) : 0;
+  int64_t m_last = major ? (2 * minor * k_hi + major) / (2 * major) : 0;
+  int64_t a = a0 + sa * k_lo;
+  int64_t b = b0 + sb * m;
+  int64_t a_last = a0 + sa * k_hi;
+  int64_t b_last = b0 + sb * m_last;
+
+  line->x = (int)(x_major ? a : b);
+  line->y = (int)(x_major ? b : a);
+  line->last_x = (int)(x_major ? a_last : b_last);
+  line->last_y = (int)(x_major ? b_last : a_last);
+  line->count = (int)(k_hi - k_lo + 1);
+  line->x_major = x_major;
+  line->sx = sx;
+  line->sy = sy;
+  line->d = 2 * minor * (k_lo + 1) + major - 2 * major * (m + 1);
+  line->d_major = 2 * minor;
+  line->d_minor = 2 * major;
+  return 1;
+}
+
+int fb_line_next(FbLine *line) {
+  if (--line->count <= 0)
+    return 0;
+
+  int minor_step = line->d >= 0;
+  if (minor_step)
+    line->d -= line->d_minor;
+  line->d += line->d_major;
+
+  if (line->x_major) {
+    line->x += line->sx;
+    if (minor_step)
+      line->y += line->sy;
+  } else {
+    line->y += line->sy;
+    if (minor_step)
+      line->x += line->sx;
+  }
+  return 1;
+}
+
+void fb_draw_line(Framebuffer *fb, int x0, int y0, int x1, int y1,
+                  uint32_t color) {
+  FbLine line;
+  if (!fb_line_clip(&line, x0, y0, x1, y1, 0, 0, fb->width - 1,
+                    fb->height - 1))
+    return;
+  fb_mark_dirty(fb, line.x, line.y, line.last_x, line.last_y);
+
+  do {
+    store_pixel(fb, line.x, line.y, color);
+  } while (fb_line_next(&line));
 }
 
 void fb_draw_rect(Framebuffer *fb, int x0, int y0, int x1, int y1,
@@ -76,14 +661,79 @@ void fb_draw_rect(Framebuffer *fb, int x0, int y0, int x1, int y1,
   int right = imax(x0, x1);
   int top = imin(y0, y1);
   int bottom = imax(y0, y1);
+  if (right < 0 || bottom < 0 || left >= fb->width || top >= fb->height)
+    return;
+
+  // Every edge pixel is written once, so translucent outlines stay even.
+  fb_fill_span(fb, left, right, top, color);
+  if (bottom != top)
+    fb_fill_span(fb, left, right, bottom, color);
 
-  for (int x = left; x <= right; x++) {
-    fb_put_pixel(fb, x, top, color);
-    fb_put_pixel(fb, x, bottom, color);
+  int y_first = imax(top + 1, 0);
+  int y_last = imin(bottom - 1, fb->height - 1);
+  if (y_first > y_last)
+    return;
+  fb_mark_dirty(fb, left, y_first, right, y_last);
+  if (left >= 0) {
+    for (int y = y_first; y <= y_last; y++) {
+      store_pixel(fb, left, y, color);
+    }
   }
-  for (int y = top; y <= bottom; y++) {
-    fb_put_pixel(fb, left, y, color);
-    fb_put_pixel(fb, right, y, color);
+  if (right != left && right < fb->width) {
+    for (int y = y_first; y <= y_last; y++) {
+      store_pixel(fb, right, y, color);
+    }
+  }
+}
+
+// Fills tile by tile. Tiles that end up entirely background-colored are handed
+// back to the shared background tile so large erases also free memory.
+static void fill_rect_tiled(Framebuffer *fb, int left, int top, int right,
+                            int bottom, uint32_t color) {
+  left = imax(left, 0);
+  top = imax(top, 0);
+  right = imin(right, fb->width - 1);
+  bottom = imin(bottom, fb->height - 1);
+  if (left > right || top > bottom)
+    return;
+  fb_mark_dirty(fb, left, top, right, bottom);
+  touch_rect(fb, left, top, right, bottom);
+
+  int replace = overwrites(fb, color);
+  for (int ty = top >> FB_TILE_SHIFT; ty <= bottom >> FB_TILE_SHIFT; ty++) {
+    int y0 = imax(top, ty << FB_TILE_SHIFT);
+    int y1 = imin(bottom, (ty << FB_TILE_SHIFT) + FB_TILE_MASK);
+    // Edge tiles are whole once their part inside the canvas is covered.
+    int tile_bottom =
+        imin(fb->height - 1, (ty << FB_TILE_SHIFT) + FB_TILE_MASK);
+
+    for (int tx = left >> FB_TILE_SHIFT; tx <= right >> FB_TILE_SHIFT; tx++) {
+      int x0 = imax(left, tx << FB_TILE_SHIFT);
+      int x1 = imin(right, (tx << FB_TILE_SHIFT) + FB_TILE_MASK);
+      int tile_right =
+          imin(fb->width - 1, (tx << FB_TILE_SHIFT) + FB_TILE_MASK);
+      int whole = x0 == tx << FB_TILE_SHIFT && x1 == tile_right &&
+                  y0 == ty << FB_TILE_SHIFT && y1 == tile_bottom;
+
+      uint32_t **slot = &fb->tiles[ty * fb->tiles_x + tx];
+      if (replace && color == fb->background &&
+          (whole || *slot == fb->solid_tile)) {
+        if (*slot != fb->solid_tile) {
+          free(*slot);
+          *slot = fb->solid_tile;
+        }
+        continue;
+      }
+
+      uint32_t *tile = tile_for_write(fb, tx, ty);
+      if (!tile)
+        continue;
+      for (int y = y0; y <= y1; y++) {
+        span_blend(tile + ((y & FB_TILE_MASK) << FB_TILE_SHIFT) +
+                       (x0 & FB_TILE_MASK),
+                   x1 - x0 + 1, color, fb->blend);
+      }
+    }
   }
 }
 
@@ -94,25 +744,95 @@ void fb_fill_rect(Framebuffer *fb, int x0, int y0, int x1, int y1,
   int top = imin(y0, y1);
   int bottom = imax(y0, y1);
 
+  if (fb->tiles) {
+    fill_rect_tiled(fb, left, top, right, bottom, color);
+    return;
+  }
+
+  top = imax(top, 0);
+  bottom = imin(bottom, fb->height - 1);
   for (int y = top; y <= bottom; y++) {
-    for (int x = left; x <= right; x++) {
-      fb_put_pixel(fb, x, y, color);
-    }
+    fb_fill_span(fb, left, right, y, color);
+  }
+}
+
+static int64_t isqrt64(int64_t v) {
+  if (v <= 0)
+    return 0;
+  int64_t x = (int64_t)sqrt((double)v);
+  while (x * x > v) {
+    x--;
+  }
+  while ((x + 1) * (x + 1) <= v) {
+    x++;
   }
+  return x;
 }
 
-static void circle_plot8(Framebuffer *fb, int cx, int cy, int x, int y,
-                         uint32_t color) {
-  fb_put_pixel(fb, cx + x, cy + y, color);
-  fb_put_pixel(fb, cx - x, cy + y, color);
-  fb_put_pixel(fb, cx + x, cy - y, color);
-  fb_put_pixel(fb, cx - x, cy - y, color);
-  fb_put_pixel(fb, cx + y, cy + x, color);
-  fb_put_pixel(fb, cx - y, cy + x, color);
-  fb_put_pixel(fb, cx + y, cy - x, color);
-  fb_put_pixel(fb, cx - y, cy - x, color);
+// The midpoint walk below keeps err = x * x - x + (y + 1)^2 - r^2 and moves
+// x whenever that is not negative, so on row y of the first octant it sits
+// on the largest x with x * (x - 1) < r^2 - y^2.
+static int64_t circle_x_at(int64_t r2, int64_t y) {
+  int64_t rest = r2 - y * y;
+  int64_t x = isqrt64(rest) + 1;
+  while (x > 0 && x * (x - 1) >= rest) {
+    x--;
+  }
+  return x;
+}
+
+// Range of offsets v for which c + s * v lands in [0, limit - 1].
+static void axis_range(int c, int s, int limit, int64_t *lo, int64_t *hi) {
+  if (s > 0) {
+    *lo = -(int64_t)c;
+    *hi = (int64_t)limit - 1 - c;
+  } else {
+    *lo = (int64_t)c - limit + 1;
+    *hi = c;
+  }
+}
+
+// Rows y of the first-octant walk whose mirrored pixel is on the canvas,
+// given that y itself must lie in [y_lo, y_hi] and the walk's x in
+// [x_lo, x_hi]. x only shrinks as y grows, so both limits are intervals.
+static void octant_range(int64_t r2, int64_t y_lo, int64_t y_hi, int64_t x_lo,
+                         int64_t x_hi, int64_t *lo, int64_t *hi) {
+  if (y_lo < 0)
+    y_lo = 0;
+  if (x_hi < 0) {
+    *lo = 1;
+    *hi = 0;
+    return;
+  }
+
+  if (x_lo > 0) {
+    int64_t t = r2 - x_lo * (x_lo - 1);
+    if (t <= 0) {
+      *lo = 1;
+      *hi = 0;
+      return;
+    }
+    int64_t y_max = isqrt64(t - 1);
+    if (y_max < y_hi)
+      y_hi = y_max;
+  }
+
+  int64_t t = r2 - (x_hi + 1) * x_hi;
+  if (t > 0) {
+    int64_t y_min = isqrt64(t);
+    if (y_min * y_min < t)
+      y_min++;
+    if (y_min > y_lo)
+      y_lo = y_min;
+  }
+
+  *lo = y_lo;
+  *hi = y_hi;
 }
 
+// Midpoint circle clipped per octant: each of the eight mirrored pixels is
+// only visible for one interval of the walk, so the walk starts at the first
+// visible row and stops after the last one, and pixels are stored unchecked.
 void fb_draw_circle(Framebuffer *fb, int cx, int cy, int radius,
                     uint32_t color) {
   if (radius <= 0) {
@@ -120,12 +840,53 @@ void fb_draw_circle(Framebuffer *fb, int cx, int cy, int radius,
     return;
   }
 
-  int x = radius;
-  int y = 0;
-  int err = 1 - x;
+  static const int sign_x[8] = {1, -1, 1, -1, 1, -1, 1, -1};
+  static const int sign_y[8] = {1, 1, -1, -1, 1, 1, -1, -1};
+  int64_t r2 = (int64_t)radius * radius;
+  int64_t lo[8], hi[8];
+  int64_t first = INT64_MAX;
+  int64_t last = -1;
+  for (int o = 0; o < 8; o++) {
+    int64_t col_lo, col_hi, row_lo, row_hi;
+    axis_range(cx, sign_x[o], fb->width, &col_lo, &col_hi);
+    axis_range(cy, sign_y[o], fb->height, &row_lo, &row_hi);
+    // The first four octants put the walk's x on the column, the rest swap
+    // the axes.
+    if (o < 4)
+      octant_range(r2, row_lo, row_hi, col_lo, col_hi, &lo[o], &hi[o]);
+    else
+      octant_range(r2, col_lo, col_hi, row_lo, row_hi, &lo[o], &hi[o]);
+    if (lo[o] <= hi[o]) {
+      if (lo[o] < first)
+        first = lo[o];
+      if (hi[o] > last)
+        last = hi[o];
+    }
+  }
+  if (first > last)
+    return;
+  fb_mark_dirty(fb, cx - radius, cy - radius, cx + radius, cy + radius);
 
-  while (x >= y) {
-    circle_plot8(fb, cx, cy, x, y, color);
+  int64_t y = first;
+  int64_t x = circle_x_at(r2, y);
+  int64_t err = x * x - x + (y + 1) * (y + 1) - r2;
+  while (x >= y && y <= last) {
+    int px = (int)x;
+    int py = (int)y;
+    for (int o = 0; o < 8; o++) {
+      if (y < lo[o] || y > hi[o])
+        continue;
+      // Mirrored pixels meet on the first row and on the diagonal; write
+      // them once so blended outlines stay even.
+      if (py == 0 && (o == 2 || o == 3 || o == 5 || o == 7))
+        continue;
+      if (px == py && o >= 4)
+        continue;
+      if (o < 4)
+        store_pixel(fb, cx + sign_x[o] * px, cy + sign_y[o] * py, color);
+      else
+        store_pixel(fb, cx + sign_x[o] * py, cy + sign_y[o] * px, color);
+    }
     y++;
     if (err < 0) {
       err += 2 * y + 1;
@@ -143,13 +904,26 @@ void fb_fill_circle(Framebuffer *fb, int cx, int cy, int radius,
     return;
   }
 
-  int r2 = radius * radius;
-  for (int y = -radius; y <= radius; y++) {
-    int yy = y * y;
-    for (int x = -radius; x <= radius; x++) {
-      if (x * x + yy <= r2) {
-        fb_put_pixel(fb, cx + x, cy + y, color);
-      }
+  if (cx + radius < 0 || cy + radius < 0 || cx - radius >= fb->width ||
+      cy - radius >= fb->height)
+    return;
+
+  // Walk the rows outward from the center, starting at the first row offset
+  // that is on the canvas above or below it. The half-width of each row only
+  // ever shrinks, so after the first it is found by stepping down from the
+  // previous one.
+  int first = imax(0, imax(-cy, cy - fb->height + 1));
+  int last = imin(radius, imax(fb->height - 1 - cy, cy));
+  int64_t r2 = (int64_t)radius * radius;
+  int64_t half = isqrt64(r2 - (int64_t)first * first);
+  for (int y = first; y <= last; y++) {
+    int64_t yy = (int64_t)y * y;
+    while (half * half + yy > r2) {
+      half--;
     }
+    int h = (int)half;
+    fb_fill_span(fb, cx - h, cx + h, cy + y, color);
+    if (y != 0)
+      fb_fill_span(fb, cx - h, cx + h, cy - y, color);
   }
 }
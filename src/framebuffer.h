@@ -1,24 +1,153 @@
 #pragma once
 
+#include "span.h"
+
+#include <stddef.h>
 #include <stdint.h>
 
 #define ARGB(a, r, g, b)                                                       \
   (((uint32_t) (a) << 24) | ((uint32_t) (r) << 16) | ((uint32_t) (g) << 8) |   \
    ((uint32_t) (b)))
 
+// Tiled framebuffers store pixels in FB_TILE_SIZE x FB_TILE_SIZE blocks that
+// are only allocated once something is painted into them. Untouched tiles
+// all point at one shared, read-only tile filled with the background color.
+#define FB_TILE_SHIFT 6
+#define FB_TILE_SIZE (1 << FB_TILE_SHIFT)
+#define FB_TILE_MASK (FB_TILE_SIZE - 1)
+#define FB_TILE_PIXELS (FB_TILE_SIZE * FB_TILE_SIZE)
+
+// Indexed framebuffers store one byte per pixel, an index into a palette of
+// FB_PALETTE_SIZE premultiplied colors. Colors passed to and returned by the
+// drawing API are then palette indices, and blend modes do not apply.
+#define FB_PALETTE_SIZE 256
+
+// Axis-aligned pixel rectangle; empty when w or h is 0.
 typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} FbRect;
+
+typedef struct Framebuffer Framebuffer;
+
+// Called once per tile-sized block, before the first write to it since
+// fb_track_begin, while the block still holds its previous contents.
+typedef void (*FbTouchFn)(void *user_data, Framebuffer *fb, int tx, int ty);
+
+struct Framebuffer {
   int width;
   int height;
-  uint32_t *pixels;
-} Framebuffer;
+  uint32_t *pixels; // flat storage, NULL for tiled and indexed framebuffers
+  uint8_t *indices; // flat storage of indexed framebuffers, else NULL
+  uint32_t *palette; // indexed framebuffers only; owned by the caller
+
+  uint32_t **tiles; // tiled storage, NULL for flat framebuffers
+  uint32_t *solid_tile;
+  uint32_t background;
+  int tiles_x; // tile grid size; also used by flat framebuffers for tracking
+  int tiles_y;
+
+  FbRect dirty; // union of everything written since the last fb_take_dirty
+
+  SpanBlend blend; // how drawing primitives combine colors with the canvas
+
+  uint8_t *touched; // per-tile flags while write tracking is active
+  FbTouchFn on_touch;
+  void *touch_data;
+};
 
 int fb_init(Framebuffer *fb, int w, int h);
+int fb_init_tiled(Framebuffer *fb, int w, int h, uint32_t background);
+int fb_init_indexed(Framebuffer *fb, int w, int h, uint32_t *palette);
 void fb_destroy(Framebuffer *fb);
 
+int fb_is_tiled(const Framebuffer *fb);
+int fb_is_indexed(const Framebuffer *fb);
+size_t fb_memory_usage(const Framebuffer *fb);
+// Bytes of one FB_TILE_SIZE x FB_TILE_SIZE block in the framebuffer's own
+// pixel format, as used by fb_read_tile and fb_swap_tile.
+size_t fb_tile_bytes(const Framebuffer *fb);
+
+// Every write through the fb_* API grows the dirty rectangle. Consumers such
+// as the texture upload take it, which also resets it to empty.
+void fb_mark_dirty(Framebuffer *fb, int x0, int y0, int x1, int y1);
+void fb_mark_all_dirty(Framebuffer *fb);
+int fb_take_dirty(Framebuffer *fb, FbRect *out);
+
+// Write tracking reports each tile once, just before it is first modified.
+int fb_track_begin(Framebuffer *fb, FbTouchFn on_touch, void *user_data);
+void fb_track_end(Framebuffer *fb);
+
+// Pixels are premultiplied ARGB. All drawing primitives below blend with the
+// current mode, which starts out as SPAN_BLEND_REPLACE; fb_clear and the
+// bulk copies always overwrite.
+void fb_set_blend(Framebuffer *fb, SpanBlend mode);
+uint32_t fb_premultiply(uint32_t argb);
+// Back to straight alpha. Fully transparent pixels keep no color and come
+// out as 0.
+uint32_t fb_unpremultiply(uint32_t argb);
+
 void fb_clear(Framebuffer *fb, uint32_t color);
 void fb_put_pixel(Framebuffer *fb, int x, int y, uint32_t color);
 uint32_t fb_get_pixel(const Framebuffer *fb, int x, int y, uint32_t fallback);
 
+// Fills the inclusive run [x0, x1] on row y, clipped to the framebuffer.
+void fb_fill_span(Framebuffer *fb, int x0, int x1, int y, uint32_t color);
+
+// Bulk copies between the framebuffer and a linear buffer. The rectangle must
+// lie inside the framebuffer; pitch is in pixels. Indexed framebuffers widen
+// their indices to one word per pixel.
+void fb_read_rect(const Framebuffer *fb, int x, int y, int w, int h,
+                  uint32_t *dst, int dst_pitch);
+void fb_write_rect(Framebuffer *fb, int x, int y, int w, int h,
+                   const uint32_t *src, int src_pitch);
+
+// Direct read access for compositing: returns the pixels starting at (x, y),
+// which must be inside the framebuffer, and stores in `*run` how many of them
+// are contiguous in memory (to the end of the tile or the row). Not for
+// indexed framebuffers, whose `indices` can be read directly.
+const uint32_t *fb_peek_run(const Framebuffer *fb, int x, int y, int *run);
+
+// Whether tile (tx, ty) of a tiled framebuffer is still the shared background
+// tile, i.e. has never been painted. Always 0 for flat framebuffers.
+int fb_tile_is_shared(const Framebuffer *fb, int tx, int ty);
+
+// Tile-sized blocks in the framebuffer's own pixel format (fb_tile_bytes),
+// laid out with a pitch of FB_TILE_SIZE pixels. Only the part of an edge tile
+// inside the framebuffer is read or written. fb_swap_tile exchanges the
+// contents of tile (tx, ty) with `*buffer`; tiled framebuffers trade the
+// storage itself, so `*buffer` may come back as a different allocation.
+void fb_read_tile(const Framebuffer *fb, int tx, int ty, uint32_t *buffer);
+void fb_write_tile(Framebuffer *fb, int tx, int ty, const uint32_t *buffer);
+void fb_swap_tile(Framebuffer *fb, int tx, int ty, uint32_t **buffer);
+
+// Bresenham walk that can start part-way along its line. fb_line_clip places
+// it on the first pixel of the full (x0, y0)-(x1, y1) walk that falls inside
+// the inclusive rectangle and limits it to the pixels inside, so a clipped
+// walk visits exactly the pixels the unclipped one would have, minus the
+// invisible ones, without stepping through them.
+typedef struct {
+  int x; // current pixel
+  int y;
+  int last_x; // final pixel inside the rectangle
+  int last_y;
+  int count; // pixels left, including the current one
+  int x_major;
+  int sx;
+  int sy;
+  int64_t d;
+  int64_t d_major; // added on every step
+  int64_t d_minor; // subtracted when the minor axis steps too
+} FbLine;
+
+// Returns 0 if no pixel of the line lies inside the rectangle.
+int fb_line_clip(FbLine *line, int x0, int y0, int x1, int y1, int left,
+                 int top, int right, int bottom);
+// Advances to the next pixel; returns 0 once the walk is past its end.
+int fb_line_next(FbLine *line);
+
 void fb_draw_line(Framebuffer *fb, int x0, int y0, int x1, int y1,
                   uint32_t color);
 void fb_draw_rect(Framebuffer *fb, int x0, int y0, int x1, int y1,
@@ -1,19 +1,308 @@
 #include "history.h"
 
+#include <SDL2/SDL.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-int history_init(History *h, int capacity, int width, int height) {
-  h->items = (uint32_t **)malloc(sizeof(uint32_t *) * capacity);
-  if (!h->items)
+// The newest steps stay uncompressed so quick undo/redo never pays for
+// unpacking; anything older is handed to the worker thread.
+#define HISTORY_HOT_STEPS 4
+
+static int imin(int a, int b) { return a < b ? a : b; }
+
+// Run-length packing of a tile of `words` words: a stream of (run length,
+// word) pairs. Returns the number of words written, or 0 if the result would
+// not be smaller than the raw tile.
+static int rle_pack(const uint32_t *src, int words, uint32_t *dst) {
+  int out = 0;
+  int i = 0;
+  while (i < words) {
+    uint32_t v = src[i];
+    int run = 1;
+    while (i + run < words && src[i + run] == v) {
+      run++;
+    }
+    if (out + 2 >= words)
+      return 0;
+    dst[out++] = (uint32_t)run;
+    dst[out++] = v;
+    i += run;
+  }
+  return out;
+}
+
+static void rle_unpack(const uint32_t *src, int words, uint32_t *dst) {
+  for (int i = 0; i < words; i += 2) {
+    uint32_t run = src[i];
+    uint32_t v = src[i + 1];
+    for (uint32_t j = 0; j < run; j++) {
+      *dst++ = v;
+    }
+  }
+}
+
+int history_pool_init(HistoryPool *pool, int max_blocks, size_t tile_bytes) {
+  pool->blocks = (uint32_t **)malloc(sizeof(uint32_t *) * max_blocks);
+  pool->lock = SDL_CreateMutex();
+  if (!pool->blocks || !pool->lock) {
+    free(pool->blocks);
+    if (pool->lock)
+      SDL_DestroyMutex((SDL_mutex *)pool->lock);
+    pool->blocks = NULL;
+    pool->lock = NULL;
     return 0;
+  }
+  pool->count = 0;
+  pool->capacity = max_blocks;
+  pool->tile_bytes = tile_bytes;
+  return 1;
+}
 
-  h->capacity = capacity;
-  h->top = -1;
-  h->size = 0;
-  h->width = width;
-  h->height = height;
+void history_pool_destroy(HistoryPool *pool) {
+  if (!pool || !pool->blocks)
+    return;
+  for (int i = 0; i < pool->count; i++) {
+    free(pool->blocks[i]);
+  }
+  free(pool->blocks);
+  SDL_DestroyMutex((SDL_mutex *)pool->lock);
+  pool->blocks = NULL;
+  pool->lock = NULL;
+  pool->count = 0;
+}
+
+static uint32_t *pool_take(HistoryPool *pool) {
+  uint32_t *block = NULL;
+  SDL_LockMutex((SDL_mutex *)pool->lock);
+  if (pool->count > 0)
+    block = pool->blocks[--pool->count];
+  SDL_UnlockMutex((SDL_mutex *)pool->lock);
+
+  if (!block)
+    block = (uint32_t *)malloc(pool->tile_bytes);
+  return block;
+}
+
+static void pool_give(HistoryPool *pool, uint32_t *block) {
+  if (!block)
+    return;
+  SDL_LockMutex((SDL_mutex *)pool->lock);
+  if (pool->count < pool->capacity) {
+    pool->blocks[pool->count++] = block;
+    block = NULL;
+  }
+  SDL_UnlockMutex((SDL_mutex *)pool->lock);
+  free(block);
+}
+
+static size_t tile_stored_bytes(const HistoryPool *pool, const HistoryTile *t) {
+  if (t->pixels)
+    return pool->tile_bytes;
+  return sizeof(uint32_t) * t->packed_words;
+}
+
+static size_t entry_stored_bytes(const HistoryPool *pool,
+                                 const HistoryEntry *e) {
+  size_t bytes = 0;
+  for (int i = 0; i < e->count; i++) {
+    bytes += tile_stored_bytes(pool, &e->tiles[i]);
+  }
+  return bytes;
+}
+
+static void entry_free(HistoryPool *pool, HistoryEntry *e) {
+  for (int i = 0; i < e->count; i++) {
+    pool_give(pool, e->tiles[i].pixels);
+    free(e->tiles[i].packed);
+  }
+  free(e->tiles);
+  memset(e, 0, sizeof(*e));
+}
+
+// Expands any packed tiles of an entry back to raw pixels.
+static int entry_unpack(HistoryPool *pool, HistoryEntry *e) {
+  for (int i = 0; i < e->count; i++) {
+    HistoryTile *t = &e->tiles[i];
+    if (t->pixels)
+      continue;
+    t->pixels = pool_take(pool);
+    if (!t->pixels)
+      return 0;
+    rle_unpack(t->packed, t->packed_words, t->pixels);
+    free(t->packed);
+    t->packed = NULL;
+    t->packed_words = 0;
+  }
+  e->packed = 0;
+  return 1;
+}
+
+static HistoryEntry *ring_at(History *h, int i) {
+  return &h->ring[(h->head + i) % h->capacity];
+}
+
+static void wait_idle(History *h, HistoryEntry *e) {
+  while (e->busy) {
+    SDL_CondWait((SDL_cond *)h->done, (SDL_mutex *)h->lock);
+  }
+}
+
+// Drops the oldest step. Caller holds the lock.
+static void ring_drop_oldest(History *h) {
+  HistoryEntry *e = ring_at(h, 0);
+  wait_idle(h, e);
+  e = ring_at(h, 0);
+  h->raw_bytes -= h->pool->tile_bytes * e->count;
+  h->stored_bytes -= entry_stored_bytes(h->pool, e);
+  entry_free(h->pool, e);
+  h->head = (h->head + 1) % h->capacity;
+  h->size--;
+}
+
+static int ring_reserve(History *h) {
+  if (h->size < h->capacity)
+    return 1;
+
+  int next = h->capacity ? h->capacity * 2 : 64;
+  HistoryEntry *ring = (HistoryEntry *)calloc(next, sizeof(HistoryEntry));
+  if (!ring)
+    return 0;
+  for (int i = 0; i < h->size; i++) {
+    ring[i] = *ring_at(h, i);
+  }
+  free(h->ring);
+  h->ring = ring;
+  h->capacity = next;
+  h->head = 0;
+  return 1;
+}
+
+static HistoryEntry *find_cold_entry(History *h) {
+  for (int i = 0; i + HISTORY_HOT_STEPS < h->size; i++) {
+    HistoryEntry *e = ring_at(h, i);
+    if (!e->packed && !e->busy)
+      return e;
+  }
+  return NULL;
+}
+
+static int has_unpacked_cold(History *h) {
+  for (int i = 0; i + HISTORY_HOT_STEPS < h->size; i++) {
+    if (!ring_at(h, i)->packed)
+      return 1;
+  }
+  return 0;
+}
+
+// Takes ownership of the entry's tiles and enforces the byte budget. Caller
+// holds the lock.
+static void ring_push(History *h, HistoryEntry *e) {
+  if (!ring_reserve(h)) {
+    if (h->size == 0) {
+      entry_free(h->pool, e);
+      return;
+    }
+    ring_drop_oldest(h);
+  }
+
+  h->size++;
+  *ring_at(h, h->size - 1) = *e;
+  h->raw_bytes += h->pool->tile_bytes * e->count;
+  h->stored_bytes += entry_stored_bytes(h->pool, e);
+  memset(e, 0, sizeof(*e));
+  SDL_CondSignal((SDL_cond *)h->wake);
+
+  // Over budget, first let the worker pack what it can; only steps that
+  // still do not fit are dropped.
+  while (h->size > 1 && h->stored_bytes > h->budget) {
+    if (has_unpacked_cold(h)) {
+      SDL_CondWait((SDL_cond *)h->done, (SDL_mutex *)h->lock);
+      continue;
+    }
+    ring_drop_oldest(h);
+  }
+}
+
+static int compress_worker(void *data) {
+  History *h = (History *)data;
+  SDL_mutex *lock = (SDL_mutex *)h->lock;
+  uint32_t scratch[FB_TILE_PIXELS];
+  int tile_words = (int)(h->pool->tile_bytes / sizeof(uint32_t));
+
+  SDL_LockMutex(lock);
+  while (!h->quit) {
+    HistoryEntry *e = find_cold_entry(h);
+    if (!e) {
+      SDL_CondWait((SDL_cond *)h->wake, lock);
+      continue;
+    }
+
+    // The tile array is not moved or freed while the entry is busy, so it can
+    // be packed without holding the lock. The entry itself may move if the
+    // ring grows, so it is found again by its tile array afterwards.
+    e->busy = 1;
+    HistoryTile *tiles = e->tiles;
+    int count = e->count;
+    SDL_UnlockMutex(lock);
+
+    uint32_t **packed = (uint32_t **)calloc(count, sizeof(uint32_t *));
+    int *words = (int *)calloc(count, sizeof(int));
+    for (int i = 0; packed && words && i < count; i++) {
+      int n = rle_pack(tiles[i].pixels, tile_words, scratch);
+      if (n == 0)
+        continue;
+      packed[i] = (uint32_t *)malloc(sizeof(uint32_t) * n);
+      if (!packed[i])
+        continue;
+      memcpy(packed[i], scratch, sizeof(uint32_t) * n);
+      words[i] = n;
+    }
+
+    SDL_LockMutex(lock);
+    for (int i = 0; i < h->size; i++) {
+      e = ring_at(h, i);
+      if (e->tiles == tiles)
+        break;
+    }
+    for (int i = 0; packed && words && i < count; i++) {
+      if (!packed[i])
+        continue;
+      h->stored_bytes -= h->pool->tile_bytes;
+      h->stored_bytes += sizeof(uint32_t) * words[i];
+      pool_give(h->pool, tiles[i].pixels);
+      tiles[i].pixels = NULL;
+      tiles[i].packed = packed[i];
+      tiles[i].packed_words = words[i];
+    }
+    free(packed);
+    free(words);
+    e->packed = 1;
+    e->busy = 0;
+    SDL_CondBroadcast((SDL_cond *)h->done);
+  }
+  SDL_UnlockMutex(lock);
+  return 0;
+}
+
+int history_init(History *h, size_t budget, HistoryPool *pool) {
+  memset(h, 0, sizeof(*h));
+  h->budget = budget;
+  h->pool = pool;
+
+  h->lock = SDL_CreateMutex();
+  h->wake = SDL_CreateCond();
+  h->done = SDL_CreateCond();
+  if (!h->lock || !h->wake || !h->done) {
+    history_destroy(h);
+    return 0;
+  }
+
+  h->worker = SDL_CreateThread(compress_worker, "history", h);
+  if (!h->worker) {
+    history_destroy(h);
+    return 0;
+  }
 
   return 1;
 }
@@ -21,58 +310,197 @@ int history_init(History *h, int capacity, int width, int height) {
 void history_destroy(History *h) {
   if (!h)
     return;
-  history_clear(h);
-  free(h->items);
-  h->items = NULL;
+
+  if (h->worker) {
+    SDL_LockMutex((SDL_mutex *)h->lock);
+    h->quit = 1;
+    SDL_CondSignal((SDL_cond *)h->wake);
+    SDL_UnlockMutex((SDL_mutex *)h->lock);
+    SDL_WaitThread((SDL_Thread *)h->worker, NULL);
+    h->worker = NULL;
+  }
+
+  if (h->lock)
+    history_clear(h);
+  free(h->ring);
+  h->ring = NULL;
+  h->capacity = 0;
+
+  if (h->done)
+    SDL_DestroyCond((SDL_cond *)h->done);
+  if (h->wake)
+    SDL_DestroyCond((SDL_cond *)h->wake);
+  if (h->lock)
+    SDL_DestroyMutex((SDL_mutex *)h->lock);
+  h->done = NULL;
+  h->wake = NULL;
+  h->lock = NULL;
 }
 
 void history_clear(History *h) {
-  for (int i = 0; i < h->size; i++) {
-    free(h->items[i]);
+  if (h->recording) {
+    fb_track_end(h->recording);
+    h->recording = NULL;
   }
+  entry_free(h->pool, &h->pending);
+
+  SDL_LockMutex((SDL_mutex *)h->lock);
+  while (h->size > 0) {
+    ring_drop_oldest(h);
+  }
+  h->head = 0;
+  SDL_UnlockMutex((SDL_mutex *)h->lock);
+}
 
-  h->top = -1;
-  h->size = 0;
+int history_is_empty(const History *h) { return h->size == 0; }
+
+void history_get_stats(History *h, HistoryStats *out) {
+  SDL_LockMutex((SDL_mutex *)h->lock);
+  out->levels = h->size;
+  out->packed_levels = 0;
+  for (int i = 0; i < h->size; i++) {
+    if (ring_at(h, i)->packed)
+      out->packed_levels++;
+  }
+  out->raw_bytes = h->raw_bytes;
+  out->stored_bytes = h->stored_bytes;
+  out->budget = h->budget;
+  SDL_UnlockMutex((SDL_mutex *)h->lock);
 }
 
-int history_push(History *h, const Framebuffer *fb) {
-  if (h->size == h->capacity) {
-    free(h->items[0]);
-    for (int i = 1; i < h->size; i++) {
-      h->items[i - 1] = h->items[i];
+static void on_tile_touched(void *user_data, Framebuffer *fb, int tx, int ty) {
+  History *h = (History *)user_data;
+  HistoryEntry *e = &h->pending;
+  if (e->failed)
+    return;
+
+  // The tile is written as soon as this returns, so a tile that can't be
+  // saved makes the whole step unusable.
+  if (e->count == e->capacity) {
+    int next = e->capacity ? e->capacity * 2 : 16;
+    HistoryTile *tiles =
+        (HistoryTile *)realloc(e->tiles, sizeof(HistoryTile) * next);
+    if (!tiles) {
+      e->failed = 1;
+      return;
     }
-    h->size--;
-    h->top--;
+    e->tiles = tiles;
+    e->capacity = next;
   }
 
-  uint32_t *copy = (uint32_t *)malloc(sizeof(uint32_t) * h->width * h->height);
-  if (!copy)
-    return 0;
+  uint32_t *pixels = pool_take(h->pool);
+  if (!pixels) {
+    e->failed = 1;
+    return;
+  }
 
-  memcpy(copy, fb->pixels, sizeof(uint32_t) * h->width * h->height);
-  h->items[++h->top] = copy;
-  h->size++;
+  // Edge tiles fill only part of the block. The rest is cleared so the
+  // packer never reads uninitialized memory and packs it consistently.
+  if (((tx + 1) << FB_TILE_SHIFT) > fb->width ||
+      ((ty + 1) << FB_TILE_SHIFT) > fb->height)
+    memset(pixels, 0, h->pool->tile_bytes);
+  fb_read_tile(fb, tx, ty, pixels);
+
+  HistoryTile *t = &e->tiles[e->count++];
+  memset(t, 0, sizeof(*t));
+  t->tx = tx;
+  t->ty = ty;
+  t->pixels = pixels;
+}
+
+int history_begin(History *h, Framebuffer *fb) {
+  history_end(h);
+  if (fb_tile_bytes(fb) != h->pool->tile_bytes)
+    return 0;
+  if (!fb_track_begin(fb, on_tile_touched, h))
+    return 0;
+  h->recording = fb;
   return 1;
 }
 
-int history_pop(History *h, Framebuffer *fb) {
-  if (h->top < 0)
+static int tile_changed(const Framebuffer *fb, const HistoryTile *t,
+                        uint32_t *scratch) {
+  size_t pixel_bytes = fb_tile_bytes(fb) / FB_TILE_PIXELS;
+  size_t pitch = pixel_bytes * FB_TILE_SIZE;
+  int w = imin(FB_TILE_SIZE, fb->width - (t->tx << FB_TILE_SHIFT));
+  int h = imin(FB_TILE_SIZE, fb->height - (t->ty << FB_TILE_SHIFT));
+  fb_read_tile(fb, t->tx, t->ty, scratch);
+  for (int row = 0; row < h; row++) {
+    if (memcmp((const uint8_t *)scratch + row * pitch,
+               (const uint8_t *)t->pixels + row * pitch,
+               pixel_bytes * w) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+int history_end(History *h) {
+  Framebuffer *fb = h->recording;
+  if (!fb)
     return 0;
+  fb_track_end(fb);
+  h->recording = NULL;
 
-  uint32_t *state = h->items[h->top--];
-  memcpy(fb->pixels, state, sizeof(uint32_t) * h->width * h->height);
-  free(state);
-  h->size--;
+  HistoryEntry *e = &h->pending;
+  if (e->failed) {
+    entry_free(h->pool, e);
+    return -1;
+  }
 
+  // Tools like the shape preview rewrite tiles with their old contents, so
+  // keep only the tiles that actually differ.
+  uint32_t scratch[FB_TILE_PIXELS];
+  int kept = 0;
+  for (int i = 0; i < e->count; i++) {
+    if (tile_changed(fb, &e->tiles[i], scratch))
+      e->tiles[kept++] = e->tiles[i];
+    else
+      pool_give(h->pool, e->tiles[i].pixels);
+  }
+  e->count = kept;
+  e->target = fb;
+
+  if (e->count == 0) {
+    entry_free(h->pool, e);
+    return 0;
+  }
+
+  SDL_LockMutex((SDL_mutex *)h->lock);
+  ring_push(h, e);
+  SDL_UnlockMutex((SDL_mutex *)h->lock);
   return 1;
 }
 
-uint32_t *history_peek_copy(const History *h) {
-  if (!h || h->top < 0)
+Framebuffer *history_step(History *from, History *to) {
+  SDL_LockMutex((SDL_mutex *)from->lock);
+  if (from->size == 0) {
+    SDL_UnlockMutex((SDL_mutex *)from->lock);
     return NULL;
+  }
 
-  uint32_t *copy = (uint32_t *)malloc(sizeof(uint32_t) * h->width * h->height);
+  HistoryEntry *newest = ring_at(from, from->size - 1);
+  wait_idle(from, newest);
+  newest = ring_at(from, from->size - 1);
+  HistoryEntry e = *newest;
+  memset(newest, 0, sizeof(*newest));
+  from->size--;
+  from->raw_bytes -= from->pool->tile_bytes * e.count;
+  from->stored_bytes -= entry_stored_bytes(from->pool, &e);
+  SDL_UnlockMutex((SDL_mutex *)from->lock);
+
+  if (!entry_unpack(from->pool, &e)) {
+    entry_free(from->pool, &e);
+    return NULL;
+  }
+
+  Framebuffer *fb = e.target;
+  for (int i = 0; i < e.count; i++) {
+    HistoryTile *t = &e.tiles[i];
+    fb_swap_tile(fb, t->tx, t->ty, &t->pixels);
+  }
 
-  memcpy(copy, h->items[h->top], sizeof(uint32_t) * h->width * h->height);
-  return copy;
+  SDL_LockMutex((SDL_mutex *)to->lock);
+  ring_push(to, &e);
+  SDL_UnlockMutex((SDL_mutex *)to->lock);
+  return fb;
 }
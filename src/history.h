@@ -1,21 +1,99 @@
 #pragma once
 
 #include "framebuffer.h"
+#include <stddef.h>
 #include <stdint.h>
 
+// One tile of an undo step. It holds the version of the tile that is not
+// currently on the canvas: the old contents on the undo stack, the new
+// contents on the redo stack. Older steps are run-length packed in the
+// background, in which case `pixels` is NULL and `packed` holds the data.
 typedef struct {
-  uint32_t **items;
-  int top;
+  int tx;
+  int ty;
+  uint32_t *pixels;
+  uint32_t *packed;
+  int packed_words;
+} HistoryTile;
+
+typedef struct {
+  Framebuffer *target; // framebuffer the step was recorded on
+  HistoryTile *tiles;
+  int count;
+  int capacity;
+  int packed; // compression has been attempted
+  int busy;   // owned by the compression worker
+  int failed; // a touched tile could not be saved while recording
+} HistoryEntry;
+
+// Cache of tile-sized buffers shared by the undo and redo stacks. Steps move
+// between the stacks and the canvas by trading buffers, and freed buffers are
+// kept here, so undo/redo does not go through the allocator. Buffers are
+// `tile_bytes` long, the fb_tile_bytes of the framebuffers being recorded.
+typedef struct {
+  void *lock;
+  uint32_t **blocks;
+  int count;
   int capacity;
+  size_t tile_bytes;
+} HistoryPool;
+
+typedef struct {
+  int levels;
+  int packed_levels;
+  size_t raw_bytes;    // size of all steps if none were compressed
+  size_t stored_bytes; // bytes actually held
+  size_t budget;
+} HistoryStats;
+
+// Undo steps are stored as the tiles an operation changed, kept in a ring
+// buffer that grows as needed. Oldest steps are dropped once the stored
+// bytes exceed the budget.
+typedef struct {
+  HistoryEntry *ring;
+  int head;
   int size;
-  int width;
-  int height;
+  int capacity;
+
+  size_t budget;
+  size_t raw_bytes;
+  size_t stored_bytes;
+
+  HistoryEntry pending;
+  Framebuffer *recording;
+  HistoryPool *pool;
+
+  void *lock;
+  void *wake;
+  void *done;
+  void *worker;
+  int quit;
 } History;
 
-int history_init(History *h, int capacity, int width, int height);
+int history_pool_init(HistoryPool *pool, int max_blocks, size_t tile_bytes);
+void history_pool_destroy(HistoryPool *pool);
+
+int history_init(History *h, size_t budget, HistoryPool *pool);
 void history_destroy(History *h);
 
 void history_clear(History *h);
-int history_push(History *h, const Framebuffer *fb);
-int history_pop(History *h, Framebuffer *fb);
-uint32_t *history_peek_copy(const History *h);
+
+// Records every tile modified on `fb` between begin and end as one undo
+// step. Tiles that end up unchanged are dropped. Fails if `fb` does not use
+// the pool's tile size.
+//
+// history_end returns 1 if a step was recorded and 0 if nothing changed. It
+// returns -1 if memory ran out for a tile's old contents: the step is then
+// dropped whole, since undoing only part of it would leave a mix of old and
+// new pixels.
+int history_begin(History *h, Framebuffer *fb);
+int history_end(History *h);
+
+// Moves the newest step of `from` onto `to`, swapping its tiles with the
+// framebuffer it was recorded on, which must still exist. Undo is
+// history_step(undo, redo), redo the reverse. Both stacks must share a pool.
+// Returns the framebuffer that changed, or NULL if there was nothing to do.
+Framebuffer *history_step(History *from, History *to);
+
+int history_is_empty(const History *h);
+void history_get_stats(History *h, HistoryStats *out);
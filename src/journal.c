@@ -0,0 +1,287 @@
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define JOURNAL_MAX_KEYFRAMES 16
+
+static JournalTile *tile_new(Journal *j) {
+  JournalTile *t = (JournalTile *)malloc(sizeof(JournalTile) + j->tile_bytes);
+  if (!t)
+    return NULL;
+  t->refs = 1;
+  j->tile_count++;
+  return t;
+}
+
+static void tile_release(Journal *j, JournalTile *t) {
+  if (t && --t->refs == 0) {
+    free(t);
+    j->tile_count--;
+  }
+}
+
+static void keyframe_free(Journal *j, JournalKeyframe *k) {
+  int count = j->tiles_x * j->tiles_y;
+  for (int i = 0; i < count; i++) {
+    tile_release(j, k->tiles[i]);
+  }
+  free(k->tiles);
+  k->tiles = NULL;
+}
+
+// Tiles equal to the same tile of the previous keyframe, or to their left or
+// upper neighbor (large blank areas), are shared instead of copied.
+static int keyframe_take(Journal *j, const Framebuffer *fb, int op_index) {
+  JournalKeyframe k = {op_index, NULL};
+  k.tiles = (JournalTile **)calloc((size_t)j->tiles_x * j->tiles_y,
+                                   sizeof(JournalTile *));
+  if (!k.tiles)
+    return 0;
+
+  const JournalKeyframe *prev =
+      j->keyframe_count > 0 ? &j->keyframes[j->keyframe_count - 1] : NULL;
+  JournalTile *scratch = NULL;
+  for (int ty = 0; ty < j->tiles_y; ty++) {
+    for (int tx = 0; tx < j->tiles_x; tx++) {
+      int i = ty * j->tiles_x + tx;
+      if (fb_tile_is_shared(fb, tx, ty))
+        continue;
+      if (!scratch && !(scratch = tile_new(j))) {
+        keyframe_free(j, &k);
+        return 0;
+      }
+      // Edge tiles are only partly read; keep the rest comparable.
+      if (((tx + 1) << FB_TILE_SHIFT) > j->width ||
+          ((ty + 1) << FB_TILE_SHIFT) > j->height)
+        memset(scratch->pixels, 0, j->tile_bytes);
+      fb_read_tile(fb, tx, ty, scratch->pixels);
+
+      JournalTile *candidates[3] = {prev ? prev->tiles[i] : NULL,
+                                    tx > 0 ? k.tiles[i - 1] : NULL,
+                                    ty > 0 ? k.tiles[i - j->tiles_x] : NULL};
+      for (int c = 0; c < 3 && !k.tiles[i]; c++) {
+        JournalTile *t = candidates[c];
+        if (t && memcmp(t->pixels, scratch->pixels, j->tile_bytes) == 0) {
+          t->refs++;
+          k.tiles[i] = t;
+        }
+      }
+      if (!k.tiles[i]) {
+        k.tiles[i] = scratch;
+        scratch = NULL;
+      }
+    }
+  }
+  tile_release(j, scratch);
+
+  // Thin out older keyframes once the list is full. Keyframe 0 is the base
+  // state and is always kept.
+  if (j->keyframe_count == JOURNAL_MAX_KEYFRAMES) {
+    int kept = 1;
+    for (int i = 1; i < j->keyframe_count; i++) {
+      if (i % 2 == 0)
+        j->keyframes[kept++] = j->keyframes[i];
+      else
+        keyframe_free(j, &j->keyframes[i]);
+    }
+    j->keyframe_count = kept;
+    j->interval *= 2;
+  }
+
+  j->keyframes[j->keyframe_count++] = k;
+  return 1;
+}
+
+// Writes every tile of the keyframe back; background tiles of a tiled canvas
+// go back to being shared.
+static void keyframe_restore(const Journal *j, Framebuffer *fb,
+                             const JournalKeyframe *k) {
+  SpanBlend blend = fb->blend;
+  fb_set_blend(fb, SPAN_BLEND_REPLACE);
+  for (int ty = 0; ty < j->tiles_y; ty++) {
+    for (int tx = 0; tx < j->tiles_x; tx++) {
+      const JournalTile *t = k->tiles[ty * j->tiles_x + tx];
+      if (t) {
+        fb_write_tile(fb, tx, ty, t->pixels);
+      } else if (!fb_tile_is_shared(fb, tx, ty)) {
+        int x = tx << FB_TILE_SHIFT;
+        int y = ty << FB_TILE_SHIFT;
+        fb_fill_rect(fb, x, y, x + FB_TILE_MASK, y + FB_TILE_MASK,
+                     fb->background);
+      }
+    }
+  }
+  fb_set_blend(fb, blend);
+}
+
+static void keyframes_free(Journal *j, int from) {
+  for (int i = from; i < j->keyframe_count; i++) {
+    keyframe_free(j, &j->keyframes[i]);
+  }
+  if (from < j->keyframe_count)
+    j->keyframe_count = from;
+}
+
+int journal_init(Journal *j, const Framebuffer *fb, int interval,
+                 JournalReplayFn replay, void *user_data) {
+  memset(j, 0, sizeof(*j));
+  j->keyframes = (JournalKeyframe *)malloc(sizeof(JournalKeyframe) *
+                                           JOURNAL_MAX_KEYFRAMES);
+  if (!j->keyframes)
+    return 0;
+
+  j->replay = replay;
+  j->user_data = user_data;
+  j->interval = interval > 0 ? interval : 1;
+  if (!journal_reset(j, fb)) {
+    free(j->keyframes);
+    j->keyframes = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+void journal_destroy(Journal *j) {
+  if (!j)
+    return;
+  if (j->keyframes)
+    keyframes_free(j, 0);
+  free(j->keyframes);
+  free(j->ops);
+  free(j->points);
+  memset(j, 0, sizeof(*j));
+}
+
+int journal_reset(Journal *j, const Framebuffer *fb) {
+  keyframes_free(j, 0);
+  j->count = 0;
+  j->total = 0;
+  j->point_count = 0;
+  j->recording = 0;
+  j->failed = 0;
+  j->width = fb->width;
+  j->height = fb->height;
+  j->tiles_x = (fb->width + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  j->tiles_y = (fb->height + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  j->tile_bytes = fb_tile_bytes(fb);
+  return keyframe_take(j, fb, 0);
+}
+
+void journal_begin(Journal *j, int tool, int fill, int radius, uint32_t color,
+                   int blend) {
+  // A new op discards everything that could still be redone.
+  j->total = j->count;
+  j->point_count = j->count > 0 ? j->ops[j->count - 1].first_point +
+                                      j->ops[j->count - 1].point_count
+                                : 0;
+  int keep = j->keyframe_count;
+  while (keep > 1 && j->keyframes[keep - 1].op_index > j->count) {
+    keep--;
+  }
+  keyframes_free(j, keep);
+
+  // The op is drawn either way; without room for it, journal_end has to
+  // start over from the canvas.
+  j->recording = 1;
+  j->failed = 0;
+  if (j->total == j->capacity) {
+    int next = j->capacity ? j->capacity * 2 : 64;
+    JournalOp *ops = (JournalOp *)realloc(j->ops, sizeof(JournalOp) * next);
+    if (!ops) {
+      j->failed = 1;
+      return;
+    }
+    j->ops = ops;
+    j->capacity = next;
+  }
+
+  JournalOp *op = &j->ops[j->total];
+  op->tool = tool;
+  op->fill = fill;
+  op->radius = radius;
+  op->color = color;
+  op->blend = blend;
+  op->first_point = j->point_count;
+  op->point_count = 0;
+}
+
+void journal_add_point(Journal *j, int x, int y) {
+  if (!j->recording || j->failed)
+    return;
+
+  if (j->point_count == j->point_capacity) {
+    int next = j->point_capacity ? j->point_capacity * 2 : 256;
+    JournalPoint *points =
+        (JournalPoint *)realloc(j->points, sizeof(JournalPoint) * next);
+    if (!points) {
+      j->failed = 1;
+      return;
+    }
+    j->points = points;
+    j->point_capacity = next;
+  }
+
+  JournalPoint p = {x, y};
+  j->points[j->point_count++] = p;
+  j->ops[j->total].point_count++;
+}
+
+int journal_end(Journal *j, const Framebuffer *fb) {
+  if (!j->recording)
+    return 0;
+  j->recording = 0;
+  if (j->failed) {
+    journal_reset(j, fb);
+    return -1;
+  }
+  if (j->ops[j->total].point_count == 0)
+    return 0;
+
+  j->count++;
+  j->total = j->count;
+  if (j->keyframe_count == 0)
+    return 1;
+
+  int last = j->keyframes[j->keyframe_count - 1].op_index;
+  if (j->count - last >= j->interval)
+    keyframe_take(j, fb, j->count);
+  return 1;
+}
+
+int journal_undo(Journal *j, Framebuffer *fb) {
+  if (j->recording || j->count == 0 || j->keyframe_count == 0)
+    return 0;
+  j->count--;
+
+  int k = j->keyframe_count - 1;
+  while (k > 0 && j->keyframes[k].op_index > j->count) {
+    k--;
+  }
+
+  const JournalKeyframe *key = &j->keyframes[k];
+  keyframe_restore(j, fb, key);
+  for (int i = key->op_index; i < j->count; i++) {
+    j->replay(fb, &j->ops[i], j->points + j->ops[i].first_point,
+              j->user_data);
+  }
+  return 1;
+}
+
+int journal_redo(Journal *j, Framebuffer *fb) {
+  if (j->recording || j->count == j->total)
+    return 0;
+
+  const JournalOp *op = &j->ops[j->count];
+  j->replay(fb, op, j->points + op->first_point, j->user_data);
+  j->count++;
+  return 1;
+}
+
+size_t journal_memory_usage(const Journal *j) {
+  return sizeof(JournalOp) * j->capacity +
+         sizeof(JournalPoint) * j->point_capacity +
+         sizeof(JournalTile *) * (size_t)j->tiles_x * j->tiles_y *
+             j->keyframe_count +
+         (sizeof(JournalTile) + j->tile_bytes) * j->tile_count;
+}
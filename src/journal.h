@@ -0,0 +1,90 @@
+#pragma once
+
+#include "framebuffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  int x;
+  int y;
+} JournalPoint;
+
+// One recorded drawing command. What `tool`, `fill`, `blend` and the points
+// mean is up to the replay callback; the journal only stores them.
+typedef struct {
+  int tool;
+  int fill;
+  int radius;
+  uint32_t color;
+  int blend;
+  int first_point;
+  int point_count;
+} JournalOp;
+
+// One tile of keyframe contents in the canvas's own pixel format. Keyframes
+// share the tiles that did not change between them.
+typedef struct {
+  int refs;
+  uint32_t pixels[];
+} JournalTile;
+
+typedef struct {
+  int op_index; // canvas state before ops[op_index] is applied
+  JournalTile **tiles; // NULL where a tiled canvas shows its background tile
+} JournalKeyframe;
+
+typedef void (*JournalReplayFn)(Framebuffer *fb, const JournalOp *op,
+                                const JournalPoint *points, void *user_data);
+
+// History that records commands instead of pixels. Full-canvas keyframes are
+// taken every `interval` ops; undo restores the nearest earlier keyframe and
+// replays forward. When the keyframe list fills up every other keyframe is
+// dropped and the interval doubles, so memory stays bounded at any depth.
+// Keyframes are stored per tile and only tiles that differ from the previous
+// keyframe take new memory.
+typedef struct {
+  JournalOp *ops;
+  int count; // ops currently applied to the canvas
+  int total; // count plus ops available for redo
+  int capacity;
+
+  JournalPoint *points;
+  int point_count;
+  int point_capacity;
+
+  JournalKeyframe *keyframes;
+  int keyframe_count;
+  int interval;
+  int tile_count; // distinct JournalTiles held by the keyframes
+
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  size_t tile_bytes;
+  int recording;
+  int failed; // the op being recorded lost data to a failed allocation
+
+  JournalReplayFn replay;
+  void *user_data;
+} Journal;
+
+int journal_init(Journal *j, const Framebuffer *fb, int interval,
+                 JournalReplayFn replay, void *user_data);
+void journal_destroy(Journal *j);
+
+// Forgets all ops and takes a fresh base keyframe of `fb`.
+int journal_reset(Journal *j, const Framebuffer *fb);
+
+void journal_begin(Journal *j, int tool, int fill, int radius, uint32_t color,
+                   int blend);
+void journal_add_point(Journal *j, int x, int y);
+// Returns 1 if the op was recorded and 0 if it drew nothing. An op that could
+// not be recorded in full cannot be replayed, so the journal then starts over
+// from the current canvas as by journal_reset and -1 is returned.
+int journal_end(Journal *j, const Framebuffer *fb);
+
+int journal_undo(Journal *j, Framebuffer *fb);
+int journal_redo(Journal *j, Framebuffer *fb);
+
+size_t journal_memory_usage(const Journal *j);
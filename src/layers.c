@@ -0,0 +1,253 @@
+#include "layers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void rect_union(FbRect *acc, const FbRect *r) {
+  if (r->w <= 0 || r->h <= 0)
+    return;
+  if (acc->w <= 0 || acc->h <= 0) {
+    *acc = *r;
+    return;
+  }
+  int left = acc->x < r->x ? acc->x : r->x;
+  int top = acc->y < r->y ? acc->y : r->y;
+  int right = acc->x + acc->w > r->x + r->w ? acc->x + acc->w : r->x + r->w;
+  int bottom = acc->y + acc->h > r->y + r->h ? acc->y + acc->h : r->y + r->h;
+  acc->x = left;
+  acc->y = top;
+  acc->w = right - left;
+  acc->h = bottom - top;
+}
+
+static FbRect full_rect(const LayerStack *ls) {
+  FbRect r = {0, 0, ls->composite.width, ls->composite.height};
+  return r;
+}
+
+static Layer *layer_create(int w, int h, uint32_t background) {
+  Layer *layer = (Layer *)malloc(sizeof(Layer));
+  if (!layer)
+    return NULL;
+  if (!fb_init_tiled(&layer->fb, w, h, background)) {
+    free(layer);
+    return NULL;
+  }
+  layer->visible = 1;
+  layer->opacity = 255;
+  layer->blend = SPAN_BLEND_OVER;
+  return layer;
+}
+
+static void layer_free(Layer *layer) {
+  if (!layer)
+    return;
+  fb_destroy(&layer->fb);
+  free(layer);
+}
+
+int layers_init(LayerStack *ls, int w, int h, uint32_t background) {
+  memset(ls, 0, sizeof(*ls));
+  if (!fb_init_tiled(&ls->composite, w, h, background))
+    return 0;
+
+  ls->layers[0] = layer_create(w, h, background);
+  if (!ls->layers[0]) {
+    fb_destroy(&ls->composite);
+    return 0;
+  }
+  ls->count = 1;
+  ls->active = 0;
+  ls->below_for = -1;
+  ls->stale = full_rect(ls);
+  return 1;
+}
+
+void layers_destroy(LayerStack *ls) {
+  if (!ls)
+    return;
+  for (int i = 0; i < ls->count; i++) {
+    layer_free(ls->layers[i]);
+  }
+  fb_destroy(&ls->below);
+  fb_destroy(&ls->composite);
+  memset(ls, 0, sizeof(*ls));
+}
+
+int layers_add(LayerStack *ls) {
+  if (ls->count == LAYER_MAX)
+    return 0;
+  Layer *layer = layer_create(ls->composite.width, ls->composite.height, 0);
+  if (!layer)
+    return 0;
+
+  // A fresh transparent layer changes nothing on screen.
+  FbRect unused;
+  fb_take_dirty(&layer->fb, &unused);
+
+  int at = ls->active + 1;
+  memmove(&ls->layers[at + 1], &ls->layers[at],
+          sizeof(Layer *) * (ls->count - at));
+  ls->layers[at] = layer;
+  ls->count++;
+  ls->active = at;
+  return 1;
+}
+
+Framebuffer *layers_active(LayerStack *ls) {
+  return &ls->layers[ls->active]->fb;
+}
+
+void layers_select(LayerStack *ls, int index) {
+  if (index < 0)
+    index = 0;
+  if (index > ls->count - 1)
+    index = ls->count - 1;
+  ls->active = index;
+}
+
+// A setting change can alter any pixel the layer has ever painted.
+static void invalidate_layer(LayerStack *ls, int index) {
+  FbRect all = full_rect(ls);
+  rect_union(&ls->stale, &all);
+  if (index < ls->active)
+    rect_union(&ls->below_stale, &all);
+}
+
+void layers_set_visible(LayerStack *ls, int index, int visible) {
+  Layer *layer = ls->layers[index];
+  if (layer->visible == !!visible)
+    return;
+  layer->visible = !!visible;
+  invalidate_layer(ls, index);
+}
+
+void layers_set_opacity(LayerStack *ls, int index, int opacity) {
+  Layer *layer = ls->layers[index];
+  if (opacity < 0)
+    opacity = 0;
+  if (opacity > 255)
+    opacity = 255;
+  if (layer->opacity == opacity)
+    return;
+  layer->opacity = opacity;
+  invalidate_layer(ls, index);
+}
+
+void layers_set_blend(LayerStack *ls, int index, SpanBlend blend) {
+  Layer *layer = ls->layers[index];
+  if (layer->blend == blend)
+    return;
+  layer->blend = blend;
+  invalidate_layer(ls, index);
+}
+
+// Whether layer `layer` can change pixels of tile (tx, ty). Unpainted tiles
+// of a transparent layer leave the result alone in every mode but replace.
+static int layer_touches_tile(const Layer *layer, int tx, int ty) {
+  if (!layer->visible || layer->opacity == 0)
+    return 0;
+  return !(fb_tile_is_shared(&layer->fb, tx, ty) &&
+           (layer->fb.background >> 24) == 0 &&
+           layer->blend != SPAN_BLEND_REPLACE);
+}
+
+// Flattens layers [first, last) over `base` (or transparent when NULL) into
+// the part `r` of `dst`, one tile-sized cell at a time. Cells where every
+// contributing tile is still shared come out in a single color and are
+// filled, so blank areas of `dst` stay on its shared background tile.
+static void compose(LayerStack *ls, Framebuffer *dst, const Framebuffer *base,
+                    int first, int last, FbRect r) {
+  uint32_t cell[FB_TILE_PIXELS];
+  SpanBlend blend = dst->blend;
+  fb_set_blend(dst, SPAN_BLEND_REPLACE);
+  for (int ty = r.y >> FB_TILE_SHIFT; ty <= (r.y + r.h - 1) >> FB_TILE_SHIFT;
+       ty++) {
+    int y0 = r.y > ty << FB_TILE_SHIFT ? r.y : ty << FB_TILE_SHIFT;
+    int y1 = (ty << FB_TILE_SHIFT) + FB_TILE_MASK;
+    if (y1 > r.y + r.h - 1)
+      y1 = r.y + r.h - 1;
+
+    for (int tx = r.x >> FB_TILE_SHIFT;
+         tx <= (r.x + r.w - 1) >> FB_TILE_SHIFT; tx++) {
+      int x0 = r.x > tx << FB_TILE_SHIFT ? r.x : tx << FB_TILE_SHIFT;
+      int x1 = (tx << FB_TILE_SHIFT) + FB_TILE_MASK;
+      if (x1 > r.x + r.w - 1)
+        x1 = r.x + r.w - 1;
+      int n = x1 - x0 + 1;
+
+      const Layer *used[LAYER_MAX];
+      int used_count = 0;
+      int uniform = !base || fb_tile_is_shared(base, tx, ty);
+      for (int i = first; i < last; i++) {
+        if (layer_touches_tile(ls->layers[i], tx, ty)) {
+          used[used_count++] = ls->layers[i];
+          uniform = uniform && fb_tile_is_shared(&ls->layers[i]->fb, tx, ty);
+        }
+      }
+
+      int rows = uniform ? 1 : y1 - y0 + 1;
+      for (int row = 0; row < rows; row++) {
+        int run;
+        uint32_t *d = cell + row * FB_TILE_SIZE;
+        if (base)
+          memcpy(d, fb_peek_run(base, x0, y0 + row, &run),
+                 sizeof(uint32_t) * n);
+        else
+          span_fill(d, n, 0);
+
+        for (int i = 0; i < used_count; i++) {
+          const uint32_t *s = fb_peek_run(&used[i]->fb, x0, y0 + row, &run);
+          span_composite(d, s, n, used[i]->opacity, used[i]->blend);
+        }
+      }
+      if (uniform)
+        fb_fill_rect(dst, x0, y0, x1, y1, cell[0]);
+      else
+        fb_write_rect(dst, x0, y0, n, y1 - y0 + 1, cell, FB_TILE_SIZE);
+    }
+  }
+  fb_set_blend(dst, blend);
+  fb_mark_dirty(dst, r.x, r.y, r.x + r.w - 1, r.y + r.h - 1);
+}
+
+// `below` is only needed once a layer above the bottom one is active. It
+// takes the bottom layer's background, the usual color of blank areas.
+static int below_ready(LayerStack *ls) {
+  if (ls->below.tiles)
+    return 1;
+  ls->below_for = -1;
+  return fb_init_tiled(&ls->below, ls->composite.width, ls->composite.height,
+                       ls->layers[0]->fb.background);
+}
+
+int layers_update(LayerStack *ls) {
+  FbRect changed = ls->stale;
+  FbRect below_changed = ls->below_stale;
+  memset(&ls->stale, 0, sizeof(ls->stale));
+  memset(&ls->below_stale, 0, sizeof(ls->below_stale));
+
+  for (int i = 0; i < ls->count; i++) {
+    FbRect d;
+    if (!fb_take_dirty(&ls->layers[i]->fb, &d) || !ls->layers[i]->visible)
+      continue;
+    rect_union(&changed, &d);
+    if (i < ls->active)
+      rect_union(&below_changed, &d);
+  }
+
+  // Without memory for `below` the composite is built from every layer.
+  int split = ls->active > 0 && below_ready(ls) ? ls->active : 0;
+  if (split > 0 && ls->below_for != split) {
+    below_changed = full_rect(ls);
+    ls->below_for = split;
+  }
+
+  if (split > 0 && below_changed.w > 0 && below_changed.h > 0)
+    compose(ls, &ls->below, NULL, 0, split, below_changed);
+  if (changed.w <= 0 || changed.h <= 0)
+    return 0;
+  compose(ls, &ls->composite, split > 0 ? &ls->below : NULL, split, ls->count,
+          changed);
+  return 1;
+}
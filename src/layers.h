@@ -0,0 +1,48 @@
+#pragma once
+
+#include "framebuffer.h"
+
+#define LAYER_MAX 16
+
+typedef struct {
+  Framebuffer fb; // tiled; unpainted tiles of upper layers are transparent
+  int visible;
+  int opacity; // 0-255
+  SpanBlend blend;
+} Layer;
+
+// Layers are flattened into `composite`, which is what gets displayed and
+// saved. Only regions dirtied since the last layers_update are recomposited,
+// tiles no layer has painted are skipped, and everything below the active
+// layer is kept pre-flattened in `below`, so painting costs about the same
+// whichever layer it happens on.
+typedef struct {
+  Layer *layers[LAYER_MAX]; // bottom to top; heap-allocated so framebuffer
+                            // pointers held by undo steps stay valid
+  int count;
+  int active;
+
+  Framebuffer composite; // tiled, like the layers
+  Framebuffer below; // layers [0, below_for) flattened; allocated on first use
+  int below_for;     // -1 when `below` needs a full rebuild
+  FbRect stale;       // composite area invalidated by layer settings
+  FbRect below_stale; // same for `below`
+} LayerStack;
+
+// Creates the stack with one opaque layer filled with `background`.
+int layers_init(LayerStack *ls, int w, int h, uint32_t background);
+void layers_destroy(LayerStack *ls);
+
+// Inserts a transparent layer above the active one and makes it active.
+// Returns 0 if the stack is full or memory runs out.
+int layers_add(LayerStack *ls);
+Framebuffer *layers_active(LayerStack *ls);
+void layers_select(LayerStack *ls, int index);
+
+void layers_set_visible(LayerStack *ls, int index, int visible);
+void layers_set_opacity(LayerStack *ls, int index, int opacity);
+void layers_set_blend(LayerStack *ls, int index, SpanBlend blend);
+
+// Recomposites everything that changed since the previous call and marks it
+// dirty on `composite`. Returns 1 if anything was redrawn.
+int layers_update(LayerStack *ls);
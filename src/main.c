@@ -19,9 +19,13 @@ static int make_dir(const char *path) {
 #endif
 
 #include "brush.h"
+#include "canvas_texture.h"
 #include "export.h"
+#include "fill.h"
 #include "framebuffer.h"
 #include "history.h"
+#include "journal.h"
+#include "layers.h"
 #include "ui.h"
 #include "ui_components.h"
 
@@ -30,7 +34,49 @@ static int sdl_fail(const char *msg) {
   return 1;
 }
 
-typedef enum { TOOL_BRUSH = 0, TOOL_LINE, TOOL_RECT, TOOL_CIRCLE } Tool;
+// Memory each of the undo and redo stacks may hold before dropping old steps.
+#define HISTORY_BUDGET ((size_t) 256 * 1024 * 1024)
+
+// Spare tile buffers (16 KB each) kept around for undo/redo to reuse.
+#define HISTORY_POOL_TILES 512
+
+// Upper bound on how long an idle editor sleeps between event checks.
+#define IDLE_WAIT_MS 250
+
+#define CANVAS_BACKGROUND ARGB(255, 18, 18, 18)
+
+// Canvas size when none is given on the command line. The window starts at
+// the same size but is independent of it.
+#define DEFAULT_CANVAS_WIDTH 800
+#define DEFAULT_CANVAS_HEIGHT 600
+#define CANVAS_MAX_SIZE 16384
+
+// Zoom limits. Zooming out goes as far as the smallest reduced canvas copy
+// the renderer keeps.
+#define VIEW_MIN_ZOOM (1.0f / (float) (1 << (CANVAS_TEXTURE_LEVELS - 1)))
+#define VIEW_MAX_ZOOM 20.0f
+
+// Pixel grid lines are drawn from this zoom on.
+#define GRID_MIN_ZOOM 6.0f
+
+// Smallest window the bottom panel still fits into.
+#define WINDOW_MIN_WIDTH 600
+#define WINDOW_MIN_HEIGHT 400
+
+// Ops between full-canvas keyframes when undo runs from the command journal.
+#define JOURNAL_KEYFRAME_INTERVAL 32
+
+// Bucket fill tolerances cycled through with T.
+#define FILL_TOLERANCE_STEPS 5
+static const int fill_tolerances[FILL_TOLERANCE_STEPS] = {0, 8, 16, 32, 64};
+
+typedef enum {
+  TOOL_BRUSH = 0,
+  TOOL_LINE,
+  TOOL_RECT,
+  TOOL_CIRCLE,
+  TOOL_FILL
+} Tool;
 
 typedef struct {
   float zoom;
@@ -38,6 +84,21 @@ typedef struct {
   float offset_y;
 } View;
 
+// Grid lines as one-pixel rectangles. The list is only rebuilt when the
+// view, window or canvas size changes and is drawn with a single call, so
+// the grid costs about the same every frame however many lines it has.
+typedef struct {
+  View view;
+  int canvas_w;
+  int canvas_h;
+  int win_w;
+  int win_h;
+  SDL_Rect *rects;
+  int count;
+  int capacity;
+  int valid;
+} GridCache;
+
 typedef struct {
   int drawing;
   int start_x;
@@ -47,13 +108,35 @@ typedef struct {
 
   Tool tool;
   int fill;
+  int fill_tolerance; // index into fill_tolerances
 
   int brush_radius;
   uint32_t brush_color;
-
-  uint32_t *base_pixels;
-  int base_w;
-  int base_h;
+  int opacity; // percent
+  SpanBlend blend;
+  BrushCache brushes;
+  BrushCoverage coverage; // pixels the brush stroke has already painted
+
+  // Canvas tiles under a shape being dragged, each captured the first time a
+  // preview covers it and all freed when the drag ends. `preview` is the
+  // canvas area the current preview was drawn into.
+  uint32_t **base_tiles; // NULL where nothing was captured yet
+  int base_tiles_x;
+  int base_tiles_y;
+  int base_failed; // a preview was skipped for lack of memory
+  FbRect preview;
+
+  LayerStack *layers; // NULL for indexed canvases
+  Framebuffer *canvas; // active layer, or the indexed canvas
+  History *undo;
+  History *redo;
+
+  // The textures cover the canvas and are only replaced for a new canvas;
+  // resizing the window just moves the widgets.
+  SDL_Renderer *renderer;
+  CanvasTexture *texture;
+  int window_w;
+  int window_h;
 
   View view;
   int panning;
@@ -62,6 +145,19 @@ typedef struct {
   int pan_last_y;
 
   int show_grid;
+  GridCache grid;
+
+  int needs_redraw;
+
+  // With --journal, undo replays recorded commands instead of tile deltas.
+  int journal_mode;
+  Journal journal;
+
+  // With --indexed, the canvas is a single layer of palette indices that is
+  // only expanded to colors on upload, so palette edits recolor it for free.
+  int indexed_mode;
+  int color_index;
+  uint32_t *palette;
 
   UI ui;
 
@@ -71,118 +167,170 @@ typedef struct {
   UIButton save_button;
   UIButton clear_button;
   UIStatusBar status_bar;
+  UIOverlay overlay;
   int ui_initialized;
 } App;
 
+#define PRESET_COLORS 8
+static const uint32_t preset_colors[PRESET_COLORS] = {
+    ARGB(255, 240, 240, 240), // white
+    ARGB(255, 20, 20, 20),    // black
+    ARGB(255, 255, 80, 80),   // red
+    ARGB(255, 80, 255, 80),   // green
+    ARGB(255, 80, 80, 255),   // blue
+    ARGB(255, 255, 255, 80),  // yellow
+    ARGB(255, 255, 80, 255),  // magenta
+    ARGB(255, 80, 255, 255),  // cyan
+};
+
 static uint32_t palette_color(int idx) {
-  switch (idx) {
-  case 1:
-    return ARGB(255, 240, 240, 240); // white
-  case 2:
-    return ARGB(255, 20, 20, 20); // black
-  case 3:
-    return ARGB(255, 255, 80, 80); // red
-  case 4:
-    return ARGB(255, 80, 255, 80); // green
-  case 5:
-    return ARGB(255, 80, 80, 255); // blue
-  case 6:
-    return ARGB(255, 255, 255, 80); // yellow
-  case 7:
-    return ARGB(255, 255, 80, 255); // magenta
-  case 8:
-    return ARGB(255, 80, 255, 255); // cyan
-  default:
-    return ARGB(255, 240, 240, 240);
+  if (idx < 1 || idx > PRESET_COLORS)
+    idx = 1;
+  return preset_colors[idx - 1];
+}
+
+// Default palette of indexed canvases: the background, the presets on the
+// number keys, a 6x6x6 color cube and a gray ramp.
+static void init_palette(uint32_t *palette) {
+  int n = 0;
+  palette[n++] = CANVAS_BACKGROUND;
+  for (int i = 0; i < PRESET_COLORS; i++)
+    palette[n++] = preset_colors[i];
+  for (int r = 0; r < 6; r++)
+    for (int g = 0; g < 6; g++)
+      for (int b = 0; b < 6; b++)
+        palette[n++] = ARGB(255, r * 51, g * 51, b * 51);
+  int grays = FB_PALETTE_SIZE - n;
+  for (int i = 1; i <= grays; i++) {
+    int v = i * 255 / (grays + 1);
+    palette[n++] = ARGB(255, v, v, v);
   }
 }
 
+static void clamp_int(int *v, int lo, int hi) {
+  if (*v < lo)
+    *v = lo;
+  if (*v > hi)
+    *v = hi;
+}
+
 static int view_screen_to_canvas(const View *v, int sx, int sy, int *out_x,
                                  int *out_y) {
   if (v->zoom <= 0.0001f)
     return 0;
   float cx = (sx - v->offset_x) / v->zoom;
   float cy = (sy - v->offset_y) / v->zoom;
-  *out_x = (int) cx;
-  *out_y = (int) cy;
+  *out_x = (int) floorf(cx);
+  *out_y = (int) floorf(cy);
   return 1;
 }
 
-static SDL_Rect view_canvas_to_screen_rect(const View *v, int canvas_w,
-                                           int canvas_h) {
-  SDL_Rect r;
-  r.x = (int) v->offset_x;
-  r.y = (int) v->offset_y;
-  r.w = (int) (canvas_w * v->zoom);
-  r.h = (int) (canvas_h * v->zoom);
-  return r;
+// Left screen edge of canvas column (or row) `c`. Every pixel edge is
+// rounded the same way, so parts of the canvas drawn separately line up.
+static int view_canvas_to_screen(float offset, float zoom, int c) {
+  return (int) floorf(offset + (float) c * zoom);
 }
 
-static void render_grid(SDL_Renderer *r, const View *v, int canvas_w,
-                        int canvas_h) {
-  if (v->zoom < 6.0f)
-    return;
-
-  SDL_Rect dst = view_canvas_to_screen_rect(v, canvas_w, canvas_h);
+// The part of a canvas_w x canvas_h canvas that shows in a win_w x win_h
+// window, widened to whole pixels, and where it lands on screen. Returns 0
+// if none of the canvas is visible.
+static int view_visible_rect(const View *v, int canvas_w, int canvas_h,
+                             int win_w, int win_h, FbRect *src,
+                             SDL_Rect *dst) {
+  int x0 = (int) floorf(-v->offset_x / v->zoom);
+  int y0 = (int) floorf(-v->offset_y / v->zoom);
+  int x1 = (int) ceilf(((float) win_w - v->offset_x) / v->zoom);
+  int y1 = (int) ceilf(((float) win_h - v->offset_y) / v->zoom);
+  clamp_int(&x0, 0, canvas_w);
+  clamp_int(&y0, 0, canvas_h);
+  clamp_int(&x1, 0, canvas_w);
+  clamp_int(&y1, 0, canvas_h);
+
+  src->x = x0;
+  src->y = y0;
+  src->w = x1 - x0;
+  src->h = y1 - y0;
+  dst->x = view_canvas_to_screen(v->offset_x, v->zoom, x0);
+  dst->y = view_canvas_to_screen(v->offset_y, v->zoom, y0);
+  dst->w = view_canvas_to_screen(v->offset_x, v->zoom, x1) - dst->x;
+  dst->h = view_canvas_to_screen(v->offset_y, v->zoom, y1) - dst->y;
+  return src->w > 0 && src->h > 0;
+}
 
-  int win_w = 0, win_h = 0;
-  SDL_GetRendererOutputSize(r, &win_w, &win_h);
+static int grid_push(GridCache *g, int x, int y, int w, int h) {
+  if (g->count == g->capacity) {
+    int capacity = g->capacity ? g->capacity * 2 : 256;
+    SDL_Rect *rects =
+        (SDL_Rect *) realloc(g->rects, sizeof(SDL_Rect) * capacity);
+    if (!rects)
+      return 0;
+    g->rects = rects;
+    g->capacity = capacity;
+  }
+  SDL_Rect *r = &g->rects[g->count++];
+  r->x = x;
+  r->y = y;
+  r->w = w;
+  r->h = h;
+  return 1;
+}
 
-  int left = dst.x;
-  int top = dst.y;
-  int right = dst.x + dst.w;
-  int bottom = dst.y + dst.h;
+// One line on every pixel edge of the visible part of the canvas, rounded
+// like the canvas itself so lines sit exactly between pixels.
+static void grid_build(GridCache *g, const View *v, int canvas_w,
+                       int canvas_h, int win_w, int win_h) {
+  g->view = *v;
+  g->canvas_w = canvas_w;
+  g->canvas_h = canvas_h;
+  g->win_w = win_w;
+  g->win_h = win_h;
+  g->valid = 1;
+  g->count = 0;
+
+  FbRect src;
+  SDL_Rect dst;
+  if (!view_visible_rect(v, canvas_w, canvas_h, win_w, win_h, &src, &dst))
+    return;
+  int left = dst.x < 0 ? 0 : dst.x;
+  int top = dst.y < 0 ? 0 : dst.y;
+  int right = dst.x + dst.w < win_w ? dst.x + dst.w : win_w;
+  int bottom = dst.y + dst.h < win_h ? dst.y + dst.h : win_h;
+
+  for (int c = src.x; c <= src.x + src.w; c++) {
+    int x = view_canvas_to_screen(v->offset_x, v->zoom, c);
+    if (x >= left && x < right && !grid_push(g, x, top, 1, bottom - top))
+      return;
+  }
+  for (int c = src.y; c <= src.y + src.h; c++) {
+    int y = view_canvas_to_screen(v->offset_y, v->zoom, c);
+    if (y >= top && y < bottom && !grid_push(g, left, y, right - left, 1))
+      return;
+  }
+}
 
-  if (right < 0 || bottom < 0 || left > win_w || top > win_h)
+static void render_grid(SDL_Renderer *r, GridCache *g, const View *v,
+                        int canvas_w, int canvas_h, int win_w, int win_h) {
+  if (v->zoom < GRID_MIN_ZOOM)
     return;
 
-  if (left < 0)
-    left = 0;
-  if (top < 0)
-    top = 0;
-  if (right > win_w)
-    right = win_w;
-  if (bottom > win_h)
-    bottom = win_h;
+  if (!g->valid || g->view.zoom != v->zoom ||
+      g->view.offset_x != v->offset_x || g->view.offset_y != v->offset_y ||
+      g->canvas_w != canvas_w || g->canvas_h != canvas_h ||
+      g->win_w != win_w || g->win_h != win_h)
+    grid_build(g, v, canvas_w, canvas_h, win_w, win_h);
+  if (g->count == 0)
+    return;
 
   SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_BLEND);
   SDL_SetRenderDrawColor(r, 255, 255, 255, 35);
-
-  float step = v->zoom;
-
-  float mod_x = fmodf(v->offset_x, step);
-  float mod_y = fmodf(v->offset_y, step);
-  if (mod_x < 0)
-    mod_x += step;
-  if (mod_y < 0)
-    mod_y += step;
-
-  float first_x = (float) left + (step - mod_x);
-  float first_y = (float) top + (step - mod_y);
-
-  for (float x = first_x; x <= (float) right; x += step) {
-    int xi = (int) (x + 0.5f);
-    SDL_RenderDrawLine(r, xi, top, xi, bottom);
-  }
-
-  for (float y = first_y; y <= (float) bottom; y += step) {
-    int yi = (int) (y + 0.5f);
-    SDL_RenderDrawLine(r, left, yi, right, yi);
-  }
-}
-
-static void clamp_int(int *v, int lo, int hi) {
-  if (*v < lo)
-    *v = lo;
-  if (*v > hi)
-    *v = hi;
+  SDL_RenderFillRects(r, g->rects, g->count);
 }
 
-static int isqrt_int(int v) {
+static int64_t isqrt_int(int64_t v) {
   if (v <= 0)
     return 0;
-  int x = v;
-  int y = (x + 1) / 2;
+  int64_t x = v;
+  int64_t y = (x + 1) / 2;
   while (y < x) {
     x = y;
     y = (x + v / x) / 2;
@@ -190,59 +338,225 @@ static int isqrt_int(int v) {
   return x;
 }
 
-static void app_base_init(App *app, int w, int h) {
-  app->base_w = w;
-  app->base_h = h;
-  app->base_pixels = (uint32_t *) malloc(sizeof(uint32_t) * w * h);
-  if (app->base_pixels)
-    memset(app->base_pixels, 0, sizeof(uint32_t) * w * h);
+// Radius of a circle dragged from its center (x0, y0) to (x1, y1). Zoomed far
+// out, drags can be long enough that the squares overflow an int, so this
+// works in 64 bits and clamps to what x0 +- r can still hold.
+static int circle_radius(int x0, int y0, int x1, int y1) {
+  const int64_t limit = 1 << 30;
+  int64_t dx = (int64_t) x1 - x0;
+  int64_t dy = (int64_t) y1 - y0;
+  dx = dx < -limit ? -limit : dx > limit ? limit : dx;
+  dy = dy < -limit ? -limit : dy > limit ? limit : dy;
+  int64_t r = isqrt_int(dx * dx + dy * dy);
+  return (int) (r < limit ? r : limit);
 }
 
-static void app_base_destroy(App *app) {
-  free(app->base_pixels);
-  app->base_pixels = NULL;
-  app->base_w = 0;
-  app->base_h = 0;
+// Stands in for captured tiles that were still the shared background tile of
+// a tiled canvas; restoring those hands them back to the background.
+static uint32_t base_background_tile;
+
+static int app_base_begin(App *app, const Framebuffer *fb) {
+  app->base_tiles_x = (fb->width + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  app->base_tiles_y = (fb->height + FB_TILE_MASK) >> FB_TILE_SHIFT;
+  app->base_tiles = (uint32_t **) calloc(
+      (size_t) app->base_tiles_x * app->base_tiles_y, sizeof(uint32_t *));
+  app->base_failed = 0;
+  memset(&app->preview, 0, sizeof(app->preview));
+  if (!app->base_tiles) {
+    printf("Cannot draw shapes (out of memory)\n");
+    return 0;
+  }
+  return 1;
 }
 
-static void app_base_capture(const App *app, const Framebuffer *fb) {
-  if (!app->base_pixels)
-    return;
-  memcpy(app->base_pixels, fb->pixels,
-         sizeof(uint32_t) * fb->width * fb->height);
+static void app_base_end(App *app) {
+  if (app->base_tiles) {
+    int count = app->base_tiles_x * app->base_tiles_y;
+    for (int i = 0; i < count; i++) {
+      if (app->base_tiles[i] != &base_background_tile)
+        free(app->base_tiles[i]);
+    }
+  }
+  free(app->base_tiles);
+  app->base_tiles = NULL;
+  app->base_tiles_x = 0;
+  app->base_tiles_y = 0;
+  memset(&app->preview, 0, sizeof(app->preview));
 }
 
-static void app_base_restore(const App *app, Framebuffer *fb) {
-  if (!app->base_pixels)
+// Captures the tiles under `r` that no preview has covered yet, so they still
+// hold the canvas from before the drag.
+static int app_base_capture(App *app, const Framebuffer *fb, const FbRect *r) {
+  int tx0 = r->x >> FB_TILE_SHIFT;
+  int ty0 = r->y >> FB_TILE_SHIFT;
+  int tx1 = (r->x + r->w - 1) >> FB_TILE_SHIFT;
+  int ty1 = (r->y + r->h - 1) >> FB_TILE_SHIFT;
+  for (int ty = ty0; ty <= ty1; ty++) {
+    for (int tx = tx0; tx <= tx1; tx++) {
+      uint32_t **slot = &app->base_tiles[ty * app->base_tiles_x + tx];
+      if (*slot)
+        continue;
+      if (fb_tile_is_shared(fb, tx, ty)) {
+        *slot = &base_background_tile;
+        continue;
+      }
+      *slot = (uint32_t *) malloc(fb_tile_bytes(fb));
+      if (!*slot)
+        return 0;
+      fb_read_tile(fb, tx, ty, *slot);
+    }
+  }
+  return 1;
+}
+
+// Puts back the tiles under the last preview. Everything outside them still
+// matches the canvas from before the drag.
+static void app_base_restore(App *app, Framebuffer *fb) {
+  FbRect r = app->preview;
+  if (!app->base_tiles || r.w <= 0 || r.h <= 0)
     return;
-  memcpy(fb->pixels, app->base_pixels,
-         sizeof(uint32_t) * fb->width * fb->height);
+
+  int tx0 = r.x >> FB_TILE_SHIFT;
+  int ty0 = r.y >> FB_TILE_SHIFT;
+  int tx1 = (r.x + r.w - 1) >> FB_TILE_SHIFT;
+  int ty1 = (r.y + r.h - 1) >> FB_TILE_SHIFT;
+  SpanBlend blend = fb->blend;
+  fb_set_blend(fb, SPAN_BLEND_REPLACE);
+  for (int ty = ty0; ty <= ty1; ty++) {
+    for (int tx = tx0; tx <= tx1; tx++) {
+      const uint32_t *tile = app->base_tiles[ty * app->base_tiles_x + tx];
+      if (tile == &base_background_tile) {
+        int x = tx << FB_TILE_SHIFT;
+        int y = ty << FB_TILE_SHIFT;
+        fb_fill_rect(fb, x, y, x + FB_TILE_MASK, y + FB_TILE_MASK,
+                     fb->background);
+      } else {
+        fb_write_tile(fb, tx, ty, tile);
+      }
+    }
+  }
+  fb_set_blend(fb, blend);
+  memset(&app->preview, 0, sizeof(app->preview));
 }
 
-static void draw_shape_preview(const App *app, Framebuffer *fb, int x, int y) {
-  if (app->tool == TOOL_LINE) {
-    fb_draw_line(fb, app->start_x, app->start_y, x, y, app->brush_color);
+static void draw_shape(Framebuffer *fb, Tool tool, int fill, uint32_t color,
+                       int x0, int y0, int x1, int y1) {
+  if (tool == TOOL_LINE) {
+    fb_draw_line(fb, x0, y0, x1, y1, color);
     return;
   }
 
-  if (app->tool == TOOL_RECT) {
-    if (app->fill)
-      fb_fill_rect(fb, app->start_x, app->start_y, x, y, app->brush_color);
+  if (tool == TOOL_RECT) {
+    if (fill)
+      fb_fill_rect(fb, x0, y0, x1, y1, color);
     else
-      fb_draw_rect(fb, app->start_x, app->start_y, x, y, app->brush_color);
+      fb_draw_rect(fb, x0, y0, x1, y1, color);
     return;
   }
 
-  if (app->tool == TOOL_CIRCLE) {
-    int dx = x - app->start_x;
-    int dy = y - app->start_y;
-    int r = isqrt_int(dx * dx + dy * dy);
-    if (app->fill)
-      fb_fill_circle(fb, app->start_x, app->start_y, r, app->brush_color);
+  if (tool == TOOL_CIRCLE) {
+    int r = circle_radius(x0, y0, x1, y1);
+    if (fill)
+      fb_fill_circle(fb, x0, y0, r, color);
     else
-      fb_draw_circle(fb, app->start_x, app->start_y, r, app->brush_color);
+      fb_draw_circle(fb, x0, y0, r, color);
+    return;
+  }
+}
+
+// Canvas area a shape from (x0, y0) to (x1, y1) can write to, clipped to the
+// framebuffer. Returns 0 if nothing of it is on the canvas.
+static int shape_bounds(const Framebuffer *fb, Tool tool, int x0, int y0,
+                        int x1, int y1, FbRect *out) {
+  int left, top, right, bottom;
+  if (tool == TOOL_CIRCLE) {
+    int r = circle_radius(x0, y0, x1, y1);
+    left = x0 - r;
+    top = y0 - r;
+    right = x0 + r;
+    bottom = y0 + r;
+  } else {
+    left = x0 < x1 ? x0 : x1;
+    top = y0 < y1 ? y0 : y1;
+    right = x0 < x1 ? x1 : x0;
+    bottom = y0 < y1 ? y1 : y0;
+  }
+
+  if (left < 0)
+    left = 0;
+  if (top < 0)
+    top = 0;
+  if (right > fb->width - 1)
+    right = fb->width - 1;
+  if (bottom > fb->height - 1)
+    bottom = fb->height - 1;
+  if (left > right || top > bottom)
+    return 0;
+
+  out->x = left;
+  out->y = top;
+  out->w = right - left + 1;
+  out->h = bottom - top + 1;
+  return 1;
+}
+
+// The brush color at the current opacity, premultiplied for the canvas, or
+// the selected palette index on indexed canvases.
+static uint32_t app_paint_color(const App *app) {
+  if (app->indexed_mode)
+    return (uint32_t) app->color_index;
+  uint32_t alpha = (uint32_t) (app->opacity * 255 / 100);
+  return fb_premultiply((app->brush_color & 0x00FFFFFF) | (alpha << 24));
+}
+
+// Replaces the previous preview with one ending at (x, y). Only the tiles
+// under the old and new shape bounds are captured and rewritten, so the cost
+// follows the shape size rather than the canvas size.
+static void draw_shape_preview(App *app, Framebuffer *fb, int x, int y) {
+  app_base_restore(app, fb);
+  FbRect bounds;
+  if (!shape_bounds(fb, app->tool, app->start_x, app->start_y, x, y, &bounds))
+    return;
+  if (!app_base_capture(app, fb, &bounds)) {
+    if (!app->base_failed)
+      printf("Shape preview skipped (out of memory)\n");
+    app->base_failed = 1;
+    return;
+  }
+  draw_shape(fb, app->tool, app->fill, app_paint_color(app), app->start_x,
+             app->start_y, x, y);
+  app->preview = bounds;
+}
+
+// Re-applies one journaled op. Brush ops are a stamp at the first point and a
+// stroke through the rest; shapes span the first and last point; bucket fills
+// start at their single point and keep their tolerance in `radius`.
+static void replay_op(Framebuffer *fb, const JournalOp *op,
+                      const JournalPoint *points, void *user_data) {
+  App *app = (App *) user_data;
+  if (op->point_count == 0)
     return;
+
+  SpanBlend blend = fb->blend;
+  fb_set_blend(fb, (SpanBlend) op->blend);
+  if (op->tool == TOOL_BRUSH) {
+    const BrushMask *mask =
+        brush_cache_get(&app->brushes, BRUSH_SHAPE_ROUND, op->radius);
+    brush_coverage_begin(&app->coverage, fb->width, fb->height);
+    brush_stamp(fb, mask, points[0].x, points[0].y, op->color,
+                &app->coverage);
+    for (int i = 1; i < op->point_count; i++)
+      brush_stroke(fb, mask, points[i - 1].x, points[i - 1].y, points[i].x,
+                   points[i].y, op->color, &app->coverage);
+  } else if (op->tool == TOOL_FILL) {
+    fill_flood(fb, points[0].x, points[0].y, op->color, op->radius);
+  } else if (op->point_count >= 2) {
+    // A shape released off the canvas was never drawn.
+    const JournalPoint *end = &points[op->point_count - 1];
+    draw_shape(fb, (Tool) op->tool, op->fill, op->color, points[0].x,
+               points[0].y, end->x, end->y);
   }
+  fb_set_blend(fb, blend);
 }
 
 void save_canvas_bmp(const Framebuffer *fb) {
@@ -281,35 +595,165 @@ static void on_color_changed(uint32_t color, void *user_data) {
   if (!app)
     return;
   app->brush_color = color;
+  app->color_index = app->color_picker.selected_index + 1;
+}
+
+// Changes one palette entry. Only the texture is refreshed; the canvas keeps
+// its indices, so everything painted with the entry changes color at once.
+static void app_set_palette_entry(App *app, int index, uint32_t color) {
+  app->palette[index] = fb_premultiply(color);
+  fb_mark_all_dirty(app->canvas);
+  if (app->ui_initialized && index >= 1 && index <= PRESET_COLORS)
+    ui_color_picker_set_color(&app->color_picker, index - 1, color);
+}
+
+// The image as displayed: the flattened layers, or the indexed canvas.
+static const Framebuffer *app_image(App *app) {
+  if (!app->layers)
+    return app->canvas;
+  layers_update(app->layers);
+  return &app->layers->composite;
+}
+
+// Clears the active layer: the bottom one to the background color, the
+// others to transparent. Indexed canvases clear to palette entry 0.
+static void app_clear_canvas(App *app) {
+  if (app->indexed_mode)
+    fb_clear(app->canvas, 0);
+  else
+    fb_clear(app->canvas,
+             app->layers->active == 0 ? CANVAS_BACKGROUND : 0);
+  history_clear(app->undo);
+  history_clear(app->redo);
+  if (app->journal_mode)
+    journal_reset(&app->journal, app->canvas);
+}
+
+// Closes the undo step of a stroke, shape or fill.
+static void app_history_end(App *app) {
+  if (app->journal_mode) {
+    if (journal_end(&app->journal, app->canvas) < 0)
+      printf("Undo history restarted (out of memory)\n");
+  } else if (history_end(app->undo) < 0) {
+    printf("Undo step dropped (out of memory)\n");
+  }
+}
+
+// A bucket fill happens on the click itself and is recorded like a one-point
+// stroke.
+static void app_flood_fill(App *app, int x, int y) {
+  uint32_t color = app_paint_color(app);
+  int tolerance = fill_tolerances[app->fill_tolerance];
+  if (app->journal_mode) {
+    journal_begin(&app->journal, TOOL_FILL, 0, tolerance, color,
+                  (int) app->blend);
+    journal_add_point(&app->journal, x, y);
+    fill_flood(app->canvas, x, y, color, tolerance);
+  } else {
+    history_begin(app->undo, app->canvas);
+    history_clear(app->redo);
+    fill_flood(app->canvas, x, y, color, tolerance);
+  }
+  app_history_end(app);
 }
 
 static void on_save_clicked(void *user_data) {
   App *app = (App *) user_data;
   if (!app)
     return;
-  Framebuffer fb;
-  fb.width = app->base_w;
-  fb.height = app->base_h;
-  fb.pixels = app->base_pixels;
-  save_canvas_bmp(&fb);
+  save_canvas_bmp(app_image(app));
 }
 
 static void on_clear_clicked(void *user_data) {
   App *app = (App *) user_data;
-  if (!app)
+  if (!app || app->drawing)
+    return;
+  app_clear_canvas(app);
+}
+
+static void app_select_layer(App *app, int index) {
+  layers_select(app->layers, index);
+  app->canvas = layers_active(app->layers);
+  fb_set_blend(app->canvas, app->blend);
+}
+
+// 100% zoom with the canvas centered in the window.
+static void app_reset_view(App *app) {
+  const Framebuffer *fb = app->canvas;
+  app->view.zoom = 1.0f;
+  app->view.offset_x = (float) ((app->window_w - fb->width) / 2);
+  app->view.offset_y = (float) ((app->window_h - fb->height) / 2);
+}
+
+// Replaces the canvas with a blank one of w x h in the same mode, dropping
+// all layers and history. The current canvas is kept if anything fails.
+static int app_new_canvas(App *app, int w, int h) {
+  CanvasTexture texture;
+  LayerStack layers;
+  Framebuffer indexed;
+  if (!canvas_texture_init(&texture, app->renderer, w, h) ||
+      (app->layers ? !layers_init(&layers, w, h, CANVAS_BACKGROUND)
+                   : !fb_init_indexed(&indexed, w, h, app->palette))) {
+    printf("New canvas failed: %dx%d (out of memory)\n", w, h);
+    canvas_texture_destroy(&texture);
+    return 0;
+  }
+
+  // Undo steps point at the old framebuffers, so they go first.
+  history_clear(app->undo);
+  history_clear(app->redo);
+  if (app->layers) {
+    layers_destroy(app->layers);
+    *app->layers = layers;
+    app_select_layer(app, 0);
+  } else {
+    fb_clear(&indexed, 0);
+    fb_destroy(app->canvas);
+    *app->canvas = indexed;
+  }
+  canvas_texture_destroy(app->texture);
+  *app->texture = texture;
+
+  if (app->journal_mode)
+    journal_reset(&app->journal, app->canvas);
+  app_reset_view(app);
+  return 1;
+}
+
+// Pins the bottom panel to the bottom edge of a w x h window.
+static void app_layout(App *app, int w, int h) {
+  app->window_w = w;
+  app->window_h = h;
+  if (!app->ui_initialized)
     return;
-  Framebuffer fb;
-  fb.width = app->base_w;
-  fb.height = app->base_h;
-  fb.pixels = app->base_pixels;
-  fb_clear(&fb, ARGB(255, 18, 18, 18));
+
+  app->color_picker.bounds.y = h - 40;
+  app->brush_size_slider.bounds.y = h - 60;
+  app->save_button.bounds.x = w - 180;
+  app->save_button.bounds.y = h - 40;
+  app->clear_button.bounds.x = w - 90;
+  app->clear_button.bounds.y = h - 40;
+  app->status_bar.bounds.y = h - 20;
+  app->status_bar.bounds.w = w;
+  ui_overlay_invalidate(&app->overlay);
+}
+
+static SpanBlend next_blend_mode(SpanBlend mode) {
+  mode = (SpanBlend) (mode + 1);
+  return mode == SPAN_BLEND_COUNT ? SPAN_BLEND_OVER : mode;
+}
+
+static void app_set_brush_radius(App *app, int radius) {
+  clamp_int(&radius, 1, BRUSH_MAX_RADIUS);
+  app->brush_radius = radius;
+  brush_cache_select(&app->brushes, BRUSH_SHAPE_ROUND, radius);
 }
 
 static void on_brush_size_changed(int value, void *user_data) {
   App *app = (App *) user_data;
   if (!app)
     return;
-  app->brush_radius = value;
+  app_set_brush_radius(app, value);
 }
 
 static const char *get_tool_name(Tool t) {
@@ -322,6 +766,8 @@ static const char *get_tool_name(Tool t) {
     return "RECT";
   case TOOL_CIRCLE:
     return "CIRCLE";
+  case TOOL_FILL:
+    return "FILL";
   }
   return "UNKNOWN";
 }
@@ -330,32 +776,88 @@ static void update_status_bar(App *app) {
   if (!app || !app->ui_initialized)
     return;
 
+  const LayerStack *ls = app->layers;
+  char size[32];
+  if (app->tool == TOOL_FILL)
+    snprintf(size, sizeof(size), "Tolerance: %d",
+             fill_tolerances[app->fill_tolerance]);
+  else
+    snprintf(size, sizeof(size), "Size: %d", app->brush_radius);
+
+  char paint[32];
+  if (app->indexed_mode)
+    snprintf(paint, sizeof(paint), "Index: %d", app->color_index);
+  else
+    snprintf(paint, sizeof(paint), "%s %d%%", span_blend_name(app->blend),
+             app->opacity);
+
+  char layer_info[64] = "";
+  if (ls) {
+    const Layer *layer = ls->layers[ls->active];
+    snprintf(layer_info, sizeof(layer_info), " | Layer %d/%d %s %d%%%s",
+             ls->active + 1, ls->count, span_blend_name(layer->blend),
+             layer->opacity * 100 / 255, layer->visible ? "" : " (hidden)");
+  }
+
   char text[256];
-  snprintf(
-      text, sizeof(text), "%s | Size: %d | Fill: %s | Grid: %s | Zoom: %d%%",
-      get_tool_name(app->tool), app->brush_radius, app->fill ? "ON" : "OFF",
-      app->show_grid ? "ON" : "OFF", (int) (app->view.zoom * 100.0f));
+  snprintf(text, sizeof(text),
+           "%s | %s | %s | Fill: %s | Grid: %s | %dx%d | Zoom: %d%%%s",
+           get_tool_name(app->tool), size, paint, app->fill ? "ON" : "OFF",
+           app->show_grid ? "ON" : "OFF", app->canvas->width,
+           app->canvas->height, (int) (app->view.zoom * 100.0f), layer_info);
 
   ui_status_bar_set_text(&app->status_bar, text);
 }
 
+// Parses a canvas size given as WIDTHxHEIGHT.
+static int parse_canvas_size(const char *s, int *w, int *h) {
+  char *end;
+  long width = strtol(s, &end, 10);
+  if (end == s || (*end != 'x' && *end != 'X'))
+    return 0;
+  const char *rest = end + 1;
+  long height = strtol(rest, &end, 10);
+  if (end == rest || *end != '\0')
+    return 0;
+  if (width < 1 || height < 1 || width > CANVAS_MAX_SIZE ||
+      height > CANVAS_MAX_SIZE)
+    return 0;
+  *w = (int) width;
+  *h = (int) height;
+  return 1;
+}
+
 int main(int argc, char **argv) {
-  (void) argc;
-  (void) argv;
+  int journal_mode = 0;
+  int indexed_mode = 0;
+  int width = DEFAULT_CANVAS_WIDTH;
+  int height = DEFAULT_CANVAS_HEIGHT;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--journal") == 0) {
+      journal_mode = 1;
+    } else if (strcmp(argv[i], "--indexed") == 0) {
+      indexed_mode = 1;
+    } else if (!parse_canvas_size(argv[i], &width, &height)) {
+      fprintf(stderr,
+              "usage: %s [--journal] [--indexed] [WIDTHxHEIGHT]\n"
+              "canvas sides must be between 1 and %d\n",
+              argv[0], CANVAS_MAX_SIZE);
+      return 1;
+    }
+  }
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0)
     return sdl_fail("SDL_Init failed");
 
-  const int width = 800;
-  const int height = 600;
-
-  SDL_Window *window =
-      SDL_CreateWindow("Pixel", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                       width, height, SDL_WINDOW_SHOWN);
+  SDL_Window *window = SDL_CreateWindow(
+      "Pixel", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+      DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT,
+      SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
   if (!window) {
     SDL_Quit();
     return sdl_fail("SDL_CreateWindow failed");
   }
+  SDL_SetWindowMinimumSize(window, WINDOW_MIN_WIDTH, WINDOW_MIN_HEIGHT);
 
   SDL_Renderer *renderer = SDL_CreateRenderer(
       window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
@@ -365,41 +867,66 @@ int main(int argc, char **argv) {
     return sdl_fail("SDL_CreateRenderer failed");
   }
 
-  SDL_Texture *texture =
-      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                        SDL_TEXTUREACCESS_STREAMING, width, height);
-  if (!texture) {
+  CanvasTexture texture;
+  if (!canvas_texture_init(&texture, renderer, width, height)) {
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
-    return sdl_fail("SDL_CreateTexture failed");
+    return 1;
   }
 
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
 
-  Framebuffer fb;
-  if (!fb_init(&fb, width, height)) {
-    SDL_DestroyTexture(texture);
+  // Only one of the two is used; the other stays empty, which is safe to
+  // destroy.
+  LayerStack layers;
+  Framebuffer indexed;
+  uint32_t palette[FB_PALETTE_SIZE];
+  memset(&layers, 0, sizeof(layers));
+  memset(&indexed, 0, sizeof(indexed));
+  init_palette(palette);
+  if (indexed_mode ? !fb_init_indexed(&indexed, width, height, palette)
+                   : !layers_init(&layers, width, height, CANVAS_BACKGROUND)) {
+    fb_destroy(&indexed);
+    canvas_texture_destroy(&texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return 1;
+  }
+
+  HistoryPool history_pool;
+  if (indexed_mode)
+    fb_clear(&indexed, 0);
+  Framebuffer *canvas = indexed_mode ? &indexed : layers_active(&layers);
+  if (!history_pool_init(&history_pool, HISTORY_POOL_TILES,
+                         fb_tile_bytes(canvas))) {
+    layers_destroy(&layers);
+    fb_destroy(&indexed);
+    canvas_texture_destroy(&texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 1;
   }
-  fb_clear(&fb, ARGB(255, 18, 18, 18));
 
   History undo, redo;
-  if (!history_init(&undo, 32, width, height)) {
-    fb_destroy(&fb);
-    SDL_DestroyTexture(texture);
+  if (!history_init(&undo, HISTORY_BUDGET, &history_pool)) {
+    history_pool_destroy(&history_pool);
+    layers_destroy(&layers);
+    fb_destroy(&indexed);
+    canvas_texture_destroy(&texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 1;
   }
-  if (!history_init(&redo, 32, width, height)) {
+  if (!history_init(&redo, HISTORY_BUDGET, &history_pool)) {
     history_destroy(&undo);
-    fb_destroy(&fb);
-    SDL_DestroyTexture(texture);
+    history_pool_destroy(&history_pool);
+    layers_destroy(&layers);
+    fb_destroy(&indexed);
+    canvas_texture_destroy(&texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -409,24 +936,43 @@ int main(int argc, char **argv) {
   App app;
   memset(&app, 0, sizeof(app));
 
-  app.brush_radius = 6;
+  brush_cache_init(&app.brushes);
+  brush_coverage_init(&app.coverage);
+  app_set_brush_radius(&app, 6);
   app.brush_color = ARGB(255, 240, 240, 240);
+  app.opacity = 100;
+  app.blend = SPAN_BLEND_OVER;
 
   app.tool = TOOL_BRUSH;
   app.fill = 0;
 
-  app.view.zoom = 1.0f;
-  app.view.offset_x = 0.0f;
-  app.view.offset_y = 0.0f;
-
   app.show_grid = 1;
 
-  app_base_init(&app, width, height);
-  if (!app.base_pixels) {
+  app.indexed_mode = indexed_mode;
+  app.palette = palette;
+  app.color_index = 1;
+  if (indexed_mode) {
+    app.canvas = canvas;
+  } else {
+    app.layers = &layers;
+    app_select_layer(&app, 0);
+  }
+  app.undo = &undo;
+  app.redo = &redo;
+  app.renderer = renderer;
+  app.texture = &texture;
+
+  app.journal_mode = journal_mode;
+  if (app.journal_mode &&
+      !journal_init(&app.journal, app.canvas, JOURNAL_KEYFRAME_INTERVAL,
+                    replay_op,
+                    &app)) {
     history_destroy(&undo);
     history_destroy(&redo);
-    fb_destroy(&fb);
-    SDL_DestroyTexture(texture);
+    history_pool_destroy(&history_pool);
+    layers_destroy(&layers);
+    fb_destroy(&indexed);
+    canvas_texture_destroy(&texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -439,67 +985,100 @@ int main(int argc, char **argv) {
   }
 
   app.ui_initialized = 0;
+  ui_overlay_init(&app.overlay);
   if (app.ui.font) {
     ui_toolbar_init(&app.toolbar, 10, 10, 1);
     ui_toolbar_add_button(&app.toolbar, "BRUSH", on_tool_selected, &app);
     ui_toolbar_add_button(&app.toolbar, "LINE", on_tool_selected, &app);
     ui_toolbar_add_button(&app.toolbar, "RECT", on_tool_selected, &app);
     ui_toolbar_add_button(&app.toolbar, "CIRCLE", on_tool_selected, &app);
+    ui_toolbar_add_button(&app.toolbar, "FILL", on_tool_selected, &app);
     ui_toolbar_set_selected(&app.toolbar, 0);
 
-    uint32_t colors[] = {ARGB(255, 240, 240, 240), ARGB(255, 20, 20, 20),
-                         ARGB(255, 255, 80, 80),   ARGB(255, 80, 255, 80),
-                         ARGB(255, 80, 80, 255),   ARGB(255, 255, 255, 80),
-                         ARGB(255, 255, 80, 255),  ARGB(255, 80, 255, 255)};
-    ui_color_picker_init(&app.color_picker, 10, height - 40, 24, colors, 8);
+    // Widgets along the bottom edge are placed by app_layout.
+    ui_color_picker_init(&app.color_picker, 10, 0, 24, preset_colors,
+                         PRESET_COLORS);
     ui_color_picker_set_callback(&app.color_picker, on_color_changed, &app);
     ui_color_picker_set_selected(&app.color_picker, 0);
 
-    ui_slider_init(&app.brush_size_slider, 250, height - 60, 150, 40,
-                   "Brush Size", 1, 64, app.brush_radius);
+    ui_slider_init(&app.brush_size_slider, 250, 0, 150, 40,
+                   "Brush Size", 1, BRUSH_MAX_RADIUS, app.brush_radius);
     ui_slider_set_callback(&app.brush_size_slider, on_brush_size_changed, &app);
 
-    ui_button_init(&app.save_button, width - 180, height - 40, 80, 30, "SAVE");
+    ui_button_init(&app.save_button, 0, 0, 80, 30, "SAVE");
     ui_button_set_callback(&app.save_button, on_save_clicked, &app);
 
-    ui_button_init(&app.clear_button, width - 90, height - 40, 80, 30, "CLEAR");
+    ui_button_init(&app.clear_button, 0, 0, 80, 30, "CLEAR");
     ui_button_set_callback(&app.clear_button, on_clear_clicked, &app);
 
-    ui_status_bar_init(&app.status_bar, 0, height - 20, width, 20);
+    ui_status_bar_init(&app.status_bar, 0, 0, 0, 20);
+
+    ui_overlay_add(&app.overlay, UI_ITEM_TOOLBAR, &app.toolbar);
+    ui_overlay_add(&app.overlay, UI_ITEM_COLOR_PICKER, &app.color_picker);
+    ui_overlay_add(&app.overlay, UI_ITEM_SLIDER, &app.brush_size_slider);
+    ui_overlay_add(&app.overlay, UI_ITEM_BUTTON, &app.save_button);
+    ui_overlay_add(&app.overlay, UI_ITEM_BUTTON, &app.clear_button);
+    ui_overlay_add(&app.overlay, UI_ITEM_STATUS_BAR, &app.status_bar);
 
     app.ui_initialized = 1;
     update_status_bar(&app);
   }
 
+  int window_w, window_h;
+  SDL_GetWindowSize(window, &window_w, &window_h);
+  app_layout(&app, window_w, window_h);
+  app_reset_view(&app);
+
+  // Frames are only produced when something changed. While idle the loop
+  // sleeps in SDL_WaitEventTimeout; once a frame is pending it drains the
+  // queue without blocking and presents at the vsync rate.
+  app.needs_redraw = 1;
+
   int running = 1;
   while (running) {
     SDL_Event e;
-    while (SDL_PollEvent(&e)) {
+    int pending;
+    if (app.needs_redraw)
+      pending = SDL_PollEvent(&e);
+    else
+      pending = SDL_WaitEventTimeout(&e, IDLE_WAIT_MS);
+
+    for (; pending; pending = SDL_PollEvent(&e)) {
       switch (e.type) {
       case SDL_QUIT:
         running = 0;
         break;
 
+      case SDL_WINDOWEVENT:
+        if (e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+          app_layout(&app, e.window.data1, e.window.data2);
+        app.needs_redraw = 1;
+        break;
+
+      case SDL_RENDER_TARGETS_RESET:
+        // Some renderers drop render target contents, e.g. on a device
+        // reset; the widgets have to be drawn again.
+        ui_overlay_invalidate(&app.overlay);
+        app.needs_redraw = 1;
+        break;
+
       case SDL_KEYDOWN: {
         SDL_Keycode key = e.key.keysym.sym;
         SDL_Keymod mod = e.key.keysym.mod;
+        app.needs_redraw = 1;
 
         if (key == SDLK_ESCAPE)
           running = 0;
 
         if (key == SDLK_LEFTBRACKET) {
-          app.brush_radius--;
-          clamp_int(&app.brush_radius, 1, 64);
+          app_set_brush_radius(&app, app.brush_radius - 1);
         }
         if (key == SDLK_RIGHTBRACKET) {
-          app.brush_radius++;
-          clamp_int(&app.brush_radius, 1, 64);
+          app_set_brush_radius(&app, app.brush_radius + 1);
         }
 
-        if (key == SDLK_c) {
-          fb_clear(&fb, ARGB(255, 18, 18, 18));
-          history_clear(&undo);
-          history_clear(&redo);
+        if (key == SDLK_c && !app.drawing) {
+          app_clear_canvas(&app);
         }
 
         if (key == SDLK_F1) {
@@ -514,50 +1093,107 @@ int main(int argc, char **argv) {
         if (key == SDLK_F4) {
           app.tool = TOOL_CIRCLE;
         }
+        if (key == SDLK_F5) {
+          app.tool = TOOL_FILL;
+        }
+        if (key == SDLK_t) {
+          app.fill_tolerance = (app.fill_tolerance + 1) % FILL_TOLERANCE_STEPS;
+        }
 
         if (key == SDLK_f) {
           app.fill = !app.fill;
         }
 
         if (key == SDLK_r) {
-          app.view.zoom = 1.0f;
-          app.view.offset_x = 0.0f;
-          app.view.offset_y = 0.0f;
+          app_reset_view(&app);
         }
 
         if (key == SDLK_g) {
           app.show_grid = !app.show_grid;
         }
 
-        if ((mod & KMOD_CTRL) && key == SDLK_z) {
-          uint32_t *prev = history_peek_copy(&undo);
-          if (prev) {
-            history_push(&redo, &fb);
-            history_pop(&undo, &fb);
-            free(prev);
-          }
+        if ((mod & KMOD_CTRL) && key == SDLK_z && !app.drawing) {
+          if (app.journal_mode)
+            journal_undo(&app.journal, app.canvas);
+          else
+            history_step(&undo, &redo);
         }
 
-        if ((mod & KMOD_CTRL) && key == SDLK_y) {
-          uint32_t *next = history_peek_copy(&redo);
-          if (next) {
-            history_push(&undo, &fb);
-            history_pop(&redo, &fb);
-            free(next);
-          }
+        if ((mod & KMOD_CTRL) && key == SDLK_y && !app.drawing) {
+          if (app.journal_mode)
+            journal_redo(&app.journal, app.canvas);
+          else
+            history_step(&redo, &undo);
+        }
+
+        // Ctrl+N starts over at the current size, Ctrl+Shift+N at the size
+        // of the window.
+        if ((mod & KMOD_CTRL) && key == SDLK_n && !app.drawing) {
+          if (mod & KMOD_SHIFT)
+            app_new_canvas(&app, app.window_w, app.window_h);
+          else
+            app_new_canvas(&app, app.canvas->width, app.canvas->height);
         }
 
         if ((mod & KMOD_CTRL) && key == SDLK_s) {
-          save_canvas_bmp(&fb);
+          save_canvas_bmp(app_image(&app));
         }
 
         if (key >= SDLK_1 && key <= SDLK_8) {
           int idx = (int) (key - SDLK_0);
-          app.brush_color = palette_color(idx);
+          if (app.indexed_mode && (mod & KMOD_SHIFT)) {
+            app_set_palette_entry(&app, app.color_index, palette_color(idx));
+          } else {
+            app.brush_color = palette_color(idx);
+            app.color_index = idx;
+            ui_color_picker_set_selected(&app.color_picker, idx - 1);
+          }
+        }
+
+        if (key == SDLK_b && !app.drawing && app.layers) {
+          if (mod & KMOD_SHIFT) {
+            Layer *layer = layers.layers[layers.active];
+            layers_set_blend(&layers, layers.active,
+                             next_blend_mode(layer->blend));
+          } else {
+            app.blend = next_blend_mode(app.blend);
+            fb_set_blend(app.canvas, app.blend);
+          }
         }
+
+        if (app.layers) {
+          if (key == SDLK_l && !app.drawing && !app.journal_mode) {
+            if (layers_add(&layers))
+              app_select_layer(&app, layers.active);
+          }
+          if (key == SDLK_PAGEUP && !app.drawing && !app.journal_mode) {
+            app_select_layer(&app, layers.active + 1);
+          }
+          if (key == SDLK_PAGEDOWN && !app.drawing && !app.journal_mode) {
+            app_select_layer(&app, layers.active - 1);
+          }
+          if (key == SDLK_v) {
+            Layer *layer = layers.layers[layers.active];
+            layers_set_visible(&layers, layers.active, !layer->visible);
+          }
+          if (key == SDLK_COMMA || key == SDLK_PERIOD) {
+            Layer *layer = layers.layers[layers.active];
+            int step = key == SDLK_COMMA ? -32 : 32;
+            layers_set_opacity(&layers, layers.active, layer->opacity + step);
+          }
+        }
+        if (key == SDLK_MINUS && app.opacity > 10) {
+          app.opacity -= 10;
+        }
+        if (key == SDLK_EQUALS && app.opacity < 100) {
+          app.opacity += 10;
+        }
+
+        update_status_bar(&app);
       } break;
 
       case SDL_MOUSEBUTTONDOWN:
+        app.needs_redraw = 1;
         if (app.ui_initialized && e.button.button == SDL_BUTTON_LEFT) {
           UIEvent ui_event;
           ui_event.type = UI_EVENT_MOUSE_DOWN;
@@ -565,12 +1201,7 @@ int main(int argc, char **argv) {
           ui_event.y = e.button.y;
           ui_event.button = e.button.button;
 
-          int handled = 0;
-          handled |= ui_toolbar_handle_event(&app.toolbar, &ui_event, &app.ui);
-          handled |= ui_color_picker_handle_event(&app.color_picker, &ui_event);
-          handled |= ui_slider_handle_event(&app.brush_size_slider, &ui_event);
-          handled |= ui_button_handle_event(&app.save_button, &ui_event);
-          handled |= ui_button_handle_event(&app.clear_button, &ui_event);
+          int handled = ui_overlay_dispatch(&app.overlay, &ui_event, &app.ui);
 
           if (handled) {
             update_status_bar(&app);
@@ -592,22 +1223,46 @@ int main(int argc, char **argv) {
           SDL_Keymod mod = SDL_GetModState();
           if (mod & KMOD_ALT) {
             int cx, cy;
+            const Framebuffer *image = app_image(&app);
             if (view_screen_to_canvas(&app.view, e.button.x, e.button.y, &cx,
-                                      &cy)) {
-              uint32_t c = fb_get_pixel(&fb, cx, cy, ARGB(255, 0, 0, 0));
-              app.brush_color = c;
+                                      &cy) &&
+                cx >= 0 && cy >= 0 && cx < image->width &&
+                cy < image->height) {
+              uint32_t fallback = app.indexed_mode ? 0 : ARGB(255, 0, 0, 0);
+              uint32_t c = fb_get_pixel(image, cx, cy, fallback);
+              if (app.indexed_mode) {
+                app.color_index = (int) (c & 0xFF);
+                c = app.palette[app.color_index];
+              }
+              // The canvas is premultiplied, the brush color is not.
+              app.brush_color = fb_unpremultiply(c);
             }
             break;
           }
 
-          history_push(&undo, &fb);
-          history_clear(&redo);
-
           int cx, cy;
           if (!view_screen_to_canvas(&app.view, e.button.x, e.button.y, &cx,
                                      &cy))
             break;
 
+          if (app.tool == TOOL_FILL) {
+            app_flood_fill(&app, cx, cy);
+            break;
+          }
+
+          if (app.tool != TOOL_BRUSH && !app_base_begin(&app, app.canvas))
+            break;
+
+          if (app.journal_mode) {
+            journal_begin(&app.journal, (int) app.tool, app.fill,
+                          app.brush_radius, app_paint_color(&app),
+                          (int) app.blend);
+            journal_add_point(&app.journal, cx, cy);
+          } else {
+            history_begin(&undo, app.canvas);
+            history_clear(&redo);
+          }
+
           app.drawing = 1;
           app.start_x = cx;
           app.start_y = cy;
@@ -615,17 +1270,20 @@ int main(int argc, char **argv) {
           app.last_y = cy;
 
           if (app.tool == TOOL_BRUSH) {
-            brush_stamp_circle(&fb, app.last_x, app.last_y, app.brush_radius,
-                               app.brush_color);
+            // Segments overlap at their joints; each pixel of the stroke is
+            // painted once so translucent strokes stay even.
+            brush_coverage_begin(&app.coverage, app.canvas->width,
+                                 app.canvas->height);
+            brush_stamp(app.canvas, app.brushes.current, app.last_x, app.last_y,
+                        app_paint_color(&app), &app.coverage);
           } else {
-            app_base_capture(&app, &fb);
-            app_base_restore(&app, &fb);
-            draw_shape_preview(&app, &fb, app.last_x, app.last_y);
+            draw_shape_preview(&app, app.canvas, app.last_x, app.last_y);
           }
         }
         break;
 
       case SDL_MOUSEBUTTONUP:
+        app.needs_redraw = 1;
         if (app.ui_initialized && e.button.button == SDL_BUTTON_LEFT) {
           UIEvent ui_event;
           ui_event.type = UI_EVENT_MOUSE_UP;
@@ -633,12 +1291,7 @@ int main(int argc, char **argv) {
           ui_event.y = e.button.y;
           ui_event.button = e.button.button;
 
-          int handled = 0;
-          handled |= ui_toolbar_handle_event(&app.toolbar, &ui_event, &app.ui);
-          handled |= ui_color_picker_handle_event(&app.color_picker, &ui_event);
-          handled |= ui_slider_handle_event(&app.brush_size_slider, &ui_event);
-          handled |= ui_button_handle_event(&app.save_button, &ui_event);
-          handled |= ui_button_handle_event(&app.clear_button, &ui_event);
+          int handled = ui_overlay_dispatch(&app.overlay, &ui_event, &app.ui);
 
           if (handled)
             break;
@@ -656,12 +1309,20 @@ int main(int argc, char **argv) {
         if (e.button.button == SDL_BUTTON_LEFT) {
           if (app.drawing && app.tool != TOOL_BRUSH) {
             int cx, cy;
-            app_base_restore(&app, &fb);
+            app_base_restore(&app, app.canvas);
             if (view_screen_to_canvas(&app.view, e.button.x, e.button.y, &cx,
                                       &cy)) {
-              draw_shape_preview(&app, &fb, cx, cy);
+              // The final shape needs no capture, so it is never skipped.
+              draw_shape(app.canvas, app.tool, app.fill,
+                         app_paint_color(&app), app.start_x, app.start_y, cx,
+                         cy);
+              if (app.journal_mode)
+                journal_add_point(&app.journal, cx, cy);
             }
+            app_base_end(&app);
           }
+          if (app.drawing)
+            app_history_end(&app);
           app.drawing = 0;
         }
         break;
@@ -674,11 +1335,9 @@ int main(int argc, char **argv) {
           ui_event.y = e.motion.y;
           ui_event.button = 0;
 
-          ui_toolbar_handle_event(&app.toolbar, &ui_event, &app.ui);
-          ui_slider_handle_event(&app.brush_size_slider, &ui_event);
-          ui_color_picker_handle_event(&app.color_picker, &ui_event);
-          ui_button_handle_event(&app.save_button, &ui_event);
-          ui_button_handle_event(&app.clear_button, &ui_event);
+          // Widgets whose hover state changes mark themselves dirty,
+          // which schedules the redraw.
+          ui_overlay_dispatch(&app.overlay, &ui_event, &app.ui);
         }
 
         if (app.panning) {
@@ -688,6 +1347,7 @@ int main(int argc, char **argv) {
           app.view.offset_y += (float) dy;
           app.pan_last_x = e.motion.x;
           app.pan_last_y = e.motion.y;
+          app.needs_redraw = 1;
           break;
         }
 
@@ -695,13 +1355,17 @@ int main(int argc, char **argv) {
           int x, y;
           if (!view_screen_to_canvas(&app.view, e.motion.x, e.motion.y, &x, &y))
             break;
+          if (x == app.last_x && y == app.last_y)
+            break;
 
           if (app.tool == TOOL_BRUSH) {
-            brush_stroke_circle(&fb, app.last_x, app.last_y, x, y,
-                                app.brush_radius, app.brush_color);
+            brush_stroke(app.canvas, app.brushes.current, app.last_x,
+                         app.last_y, x, y, app_paint_color(&app),
+                         &app.coverage);
+            if (app.journal_mode)
+              journal_add_point(&app.journal, x, y);
           } else {
-            app_base_restore(&app, &fb);
-            draw_shape_preview(&app, &fb, x, y);
+            draw_shape_preview(&app, app.canvas, x, y);
           }
 
           app.last_x = x;
@@ -710,16 +1374,17 @@ int main(int argc, char **argv) {
         break;
 
       case SDL_MOUSEWHEEL: {
+        app.needs_redraw = 1;
         int mx, my;
         SDL_GetMouseState(&mx, &my);
 
         float old = app.view.zoom;
         float factor = (e.wheel.y > 0) ? 1.1f : 0.9f;
         float next = old * factor;
-        if (next < 0.25f)
-          next = 0.25f;
-        if (next > 20.0f)
-          next = 20.0f;
+        if (next < VIEW_MIN_ZOOM)
+          next = VIEW_MIN_ZOOM;
+        if (next > VIEW_MAX_ZOOM)
+          next = VIEW_MAX_ZOOM;
 
         if (next != old) {
           float cx = (mx - app.view.offset_x) / old;
@@ -733,27 +1398,47 @@ int main(int argc, char **argv) {
       }
     }
 
-    SDL_UpdateTexture(texture, 0, fb.pixels, width * (int) sizeof(uint32_t));
+    Framebuffer *image = app.layers ? &layers.composite : app.canvas;
+    if (app.layers)
+      layers_update(&layers);
+    if (image->dirty.w > 0 || ui_overlay_dirty(&app.overlay))
+      app.needs_redraw = 1;
+    if (!app.needs_redraw)
+      continue;
+    app.needs_redraw = 0;
+
+    // Redraws changed widgets into their texture, which switches the render
+    // target, so it comes before anything is drawn to the window.
+    if (app.ui_initialized)
+      ui_overlay_update(&app.overlay, renderer, &app.ui, app.window_w,
+                        app.window_h);
+
+    // Only the part of the canvas inside the window is uploaded and drawn,
+    // from a reduced copy when zoomed out.
+    int level = canvas_texture_pick_level(&texture, app.view.zoom);
+    const CanvasLevel *lv = &texture.levels[level];
+    View level_view = app.view;
+    level_view.zoom *= (float) (1 << level);
+    FbRect src;
+    SDL_Rect dst;
+    if (!view_visible_rect(&level_view, lv->width, lv->height, app.window_w,
+                           app.window_h, &src, &dst))
+      memset(&src, 0, sizeof(src));
+    canvas_texture_update(&texture, image, level, src);
     SDL_RenderClear(renderer);
-
-    SDL_Rect dst = view_canvas_to_screen_rect(&app.view, fb.width, fb.height);
-    SDL_RenderCopy(renderer, texture, 0, &dst);
+    canvas_texture_render(&texture, level, src, &dst);
 
     if (app.show_grid)
-      render_grid(renderer, &app.view, fb.width, fb.height);
-
-    if (app.ui_initialized) {
-      ui_toolbar_render(&app.toolbar, renderer, &app.ui);
-      ui_color_picker_render(&app.color_picker, renderer);
-      ui_slider_render(&app.brush_size_slider, renderer, &app.ui);
-      ui_button_render(&app.save_button, renderer, &app.ui);
-      ui_button_render(&app.clear_button, renderer, &app.ui);
-      ui_status_bar_render(&app.status_bar, renderer, &app.ui);
-    }
+      render_grid(renderer, &app.grid, &app.view, image->width, image->height,
+                  app.window_w, app.window_h);
+
+    if (app.ui_initialized)
+      ui_overlay_render(&app.overlay, renderer, &app.ui);
 
     SDL_RenderPresent(renderer);
   }
 
+  ui_overlay_destroy(&app.overlay);
   if (app.ui_initialized) {
     ui_toolbar_destroy(&app.toolbar);
     ui_color_picker_destroy(&app.color_picker);
@@ -764,13 +1449,20 @@ int main(int argc, char **argv) {
   }
 
   ui_destroy(&app.ui);
+  free(app.grid.rects);
+
+  if (app.journal_mode)
+    journal_destroy(&app.journal);
 
   history_destroy(&undo);
   history_destroy(&redo);
-  app_base_destroy(&app);
+  history_pool_destroy(&history_pool);
+  app_base_end(&app);
+  brush_coverage_destroy(&app.coverage);
 
-  fb_destroy(&fb);
-  SDL_DestroyTexture(texture);
+  layers_destroy(&layers);
+  fb_destroy(&indexed);
+  canvas_texture_destroy(&texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
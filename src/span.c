@@ -0,0 +1,743 @@
+#include "span.h"
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Runs at least this long bypass the cache with streaming stores; anything
+// shorter is likely to be read back soon (texture upload, next stroke).
+#define SPAN_STREAM_THRESHOLD (256 * 1024)
+
+typedef void (*SpanFillFn)(uint32_t *dst, int count, uint32_t color);
+
+// Every blend mode reduces to one of two per-channel formulas with constants
+// derived from the source color, so each only needs one loop per backend:
+//   scale-add: d = add + d * scale / 255
+//   multiply:  d = (add * (255 - d.alpha) + d * scale) / 255
+// with `add` and `scale` packed one byte per channel.
+typedef void (*SpanMixFn)(uint32_t *dst, int count, uint32_t add,
+                          uint32_t scale);
+
+typedef void (*SpanCompositeFn)(uint32_t *dst, const uint32_t *src,
+                                int count, uint32_t opacity);
+
+typedef void (*SpanExpandFn)(uint32_t *dst, const uint8_t *src, int count,
+                             const uint32_t *palette);
+
+typedef void (*SpanDownsampleFn)(uint32_t *dst, const uint32_t *row0,
+                                 const uint32_t *row1, int count);
+
+// x / 255 rounded to nearest, exact for 0 <= x <= 65535 - 255. The SIMD
+// loops use the same formula so every backend produces identical pixels.
+static uint32_t div255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static void span_fill_scalar(uint32_t *dst, int count, uint32_t color) {
+  for (int i = 0; i < count; i++) {
+    dst[i] = color;
+  }
+}
+
+static void span_scale_add_scalar(uint32_t *dst, int count, uint32_t add,
+                                  uint32_t scale) {
+  for (int i = 0; i < count; i++) {
+    uint32_t d = dst[i];
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t c = ((add >> shift) & 255) +
+                   div255(((d >> shift) & 255) * ((scale >> shift) & 255));
+      out |= c << shift;
+    }
+    dst[i] = out;
+  }
+}
+
+static void span_multiply_scalar(uint32_t *dst, int count, uint32_t add,
+                                 uint32_t scale) {
+  for (int i = 0; i < count; i++) {
+    uint32_t d = dst[i];
+    uint32_t inv_alpha = 255 - (d >> 24);
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t c = div255(((add >> shift) & 255) * inv_alpha +
+                          ((d >> shift) & 255) * ((scale >> shift) & 255));
+      out |= c << shift;
+    }
+    dst[i] = out;
+  }
+}
+
+// Per-pixel form of the blend formulas for a varying source. `mode` is a
+// constant in every caller, so each wrapper below compiles to its own loop.
+static inline void composite_scalar(uint32_t *dst, const uint32_t *src,
+                                    int count, uint32_t opacity,
+                                    SpanBlend mode) {
+  for (int i = 0; i < count; i++) {
+    uint32_t s = src[i];
+    if (opacity != 255) {
+      uint32_t scaled = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        scaled |= div255(((s >> shift) & 255) * opacity) << shift;
+      }
+      s = scaled;
+    }
+    if (mode == SPAN_BLEND_REPLACE) {
+      dst[i] = s;
+      continue;
+    }
+    if (s == 0)
+      continue;
+
+    uint32_t d = dst[i];
+    uint32_t sa = s >> 24;
+    uint32_t da = d >> 24;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t sc = (s >> shift) & 255;
+      uint32_t dc = (d >> shift) & 255;
+      uint32_t c;
+      switch (mode) {
+      case SPAN_BLEND_MULTIPLY:
+        c = div255(sc * (255 - da) + dc * (255 - sa + sc));
+        break;
+      case SPAN_BLEND_SCREEN:
+        c = sc + div255(dc * (255 - sc));
+        break;
+      case SPAN_BLEND_ERASE:
+        c = div255(dc * (255 - sa));
+        break;
+      case SPAN_BLEND_OVER:
+      default:
+        c = sc + div255(dc * (255 - sa));
+        break;
+      }
+      out |= c << shift;
+    }
+    dst[i] = out;
+  }
+}
+
+static void composite_replace_scalar(uint32_t *dst, const uint32_t *src,
+                                     int count, uint32_t opacity) {
+  composite_scalar(dst, src, count, opacity, SPAN_BLEND_REPLACE);
+}
+
+static void composite_over_scalar(uint32_t *dst, const uint32_t *src,
+                                  int count, uint32_t opacity) {
+  composite_scalar(dst, src, count, opacity, SPAN_BLEND_OVER);
+}
+
+static void composite_multiply_scalar(uint32_t *dst, const uint32_t *src,
+                                      int count, uint32_t opacity) {
+  composite_scalar(dst, src, count, opacity, SPAN_BLEND_MULTIPLY);
+}
+
+static void composite_screen_scalar(uint32_t *dst, const uint32_t *src,
+                                    int count, uint32_t opacity) {
+  composite_scalar(dst, src, count, opacity, SPAN_BLEND_SCREEN);
+}
+
+static void composite_erase_scalar(uint32_t *dst, const uint32_t *src,
+                                   int count, uint32_t opacity) {
+  composite_scalar(dst, src, count, opacity, SPAN_BLEND_ERASE);
+}
+
+static void span_expand_scalar(uint32_t *dst, const uint8_t *src, int count,
+                               const uint32_t *palette) {
+  for (int i = 0; i < count; i++) {
+    dst[i] = palette[src[i]];
+  }
+}
+
+// Sums two channels at a time in 16-bit halves of a word.
+static void span_downsample_scalar(uint32_t *dst, const uint32_t *row0,
+                                   const uint32_t *row1, int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t a = row0[2 * i], b = row0[2 * i + 1];
+    uint32_t c = row1[2 * i], d = row1[2 * i + 1];
+    uint32_t rb = (a & 0x00FF00FFu) + (b & 0x00FF00FFu) + (c & 0x00FF00FFu) +
+                  (d & 0x00FF00FFu) + 0x00020002u;
+    uint32_t ag = ((a >> 8) & 0x00FF00FFu) + ((b >> 8) & 0x00FF00FFu) +
+                  ((c >> 8) & 0x00FF00FFu) + ((d >> 8) & 0x00FF00FFu) +
+                  0x00020002u;
+    dst[i] = ((rb >> 2) & 0x00FF00FFu) | (((ag >> 2) & 0x00FF00FFu) << 8);
+  }
+}
+
+static const SpanCompositeFn composite_scalar_fns[SPAN_BLEND_COUNT] = {
+    composite_replace_scalar, composite_over_scalar, composite_multiply_scalar,
+    composite_screen_scalar, composite_erase_scalar};
+
+#ifdef SPAN_X86
+__attribute__((target("sse2"))) static void
+span_fill_sse2(uint32_t *dst, int count, uint32_t color) {
+  int i = 0;
+  while (i < count && ((uintptr_t)(dst + i) & 15) != 0) {
+    dst[i++] = color;
+  }
+
+  __m128i v = _mm_set1_epi32((int)color);
+  if (count - i >= SPAN_STREAM_THRESHOLD) {
+    for (; i + 16 <= count; i += 16) {
+      _mm_stream_si128((__m128i *)(dst + i), v);
+      _mm_stream_si128((__m128i *)(dst + i + 4), v);
+      _mm_stream_si128((__m128i *)(dst + i + 8), v);
+      _mm_stream_si128((__m128i *)(dst + i + 12), v);
+    }
+    _mm_sfence();
+  }
+  for (; i + 16 <= count; i += 16) {
+    _mm_store_si128((__m128i *)(dst + i), v);
+    _mm_store_si128((__m128i *)(dst + i + 4), v);
+    _mm_store_si128((__m128i *)(dst + i + 8), v);
+    _mm_store_si128((__m128i *)(dst + i + 12), v);
+  }
+  for (; i + 4 <= count; i += 4) {
+    _mm_store_si128((__m128i *)(dst + i), v);
+  }
+  for (; i < count; i++) {
+    dst[i] = color;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+span_fill_avx2(uint32_t *dst, int count, uint32_t color) {
+  int i = 0;
+  while (i < count && ((uintptr_t)(dst + i) & 31) != 0) {
+    dst[i++] = color;
+  }
+
+  __m256i v = _mm256_set1_epi32((int)color);
+  if (count - i >= SPAN_STREAM_THRESHOLD) {
+    for (; i + 32 <= count; i += 32) {
+      _mm256_stream_si256((__m256i *)(dst + i), v);
+      _mm256_stream_si256((__m256i *)(dst + i + 8), v);
+      _mm256_stream_si256((__m256i *)(dst + i + 16), v);
+      _mm256_stream_si256((__m256i *)(dst + i + 24), v);
+    }
+    _mm_sfence();
+  }
+  for (; i + 32 <= count; i += 32) {
+    _mm256_store_si256((__m256i *)(dst + i), v);
+    _mm256_store_si256((__m256i *)(dst + i + 8), v);
+    _mm256_store_si256((__m256i *)(dst + i + 16), v);
+    _mm256_store_si256((__m256i *)(dst + i + 24), v);
+  }
+  for (; i + 8 <= count; i += 8) {
+    _mm256_store_si256((__m256i *)(dst + i), v);
+  }
+  for (; i < count; i++) {
+    dst[i] = color;
+  }
+}
+
+__attribute__((target("sse2"))) static inline __m128i div255_sse2(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Pixels are widened to 16 bits per channel, two per register half.
+__attribute__((target("sse2"))) static void
+span_scale_add_sse2(uint32_t *dst, int count, uint32_t add, uint32_t scale) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = _mm_unpacklo_epi8(_mm_set1_epi32((int)add), zero);
+  __m128i k = _mm_unpacklo_epi8(_mm_set1_epi32((int)scale), zero);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i lo = _mm_unpacklo_epi8(d, zero);
+    __m128i hi = _mm_unpackhi_epi8(d, zero);
+    lo = _mm_add_epi16(a, div255_sse2(_mm_mullo_epi16(lo, k)));
+    hi = _mm_add_epi16(a, div255_sse2(_mm_mullo_epi16(hi, k)));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  span_scale_add_scalar(dst + i, count - i, add, scale);
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+multiply_sse2(__m128i d, __m128i a, __m128i k) {
+  __m128i alpha = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(d, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+  return div255_sse2(
+      _mm_add_epi16(_mm_mullo_epi16(a, inv_alpha), _mm_mullo_epi16(d, k)));
+}
+
+__attribute__((target("sse2"))) static void
+span_multiply_sse2(uint32_t *dst, int count, uint32_t add, uint32_t scale) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = _mm_unpacklo_epi8(_mm_set1_epi32((int)add), zero);
+  __m128i k = _mm_unpacklo_epi8(_mm_set1_epi32((int)scale), zero);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i lo = multiply_sse2(_mm_unpacklo_epi8(d, zero), a, k);
+    __m128i hi = multiply_sse2(_mm_unpackhi_epi8(d, zero), a, k);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  span_multiply_scalar(dst + i, count - i, add, scale);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+div255_avx2(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void
+span_scale_add_avx2(uint32_t *dst, int count, uint32_t add, uint32_t scale) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)add), zero);
+  __m256i k = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)scale), zero);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i lo = _mm256_unpacklo_epi8(d, zero);
+    __m256i hi = _mm256_unpackhi_epi8(d, zero);
+    lo = _mm256_add_epi16(a, div255_avx2(_mm256_mullo_epi16(lo, k)));
+    hi = _mm256_add_epi16(a, div255_avx2(_mm256_mullo_epi16(hi, k)));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  span_scale_add_scalar(dst + i, count - i, add, scale);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+multiply_avx2(__m256i d, __m256i a, __m256i k) {
+  __m256i alpha = _mm256_shufflehi_epi16(
+      _mm256_shufflelo_epi16(d, _MM_SHUFFLE(3, 3, 3, 3)),
+      _MM_SHUFFLE(3, 3, 3, 3));
+  __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+  return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(a, inv_alpha),
+                                      _mm256_mullo_epi16(d, k)));
+}
+
+__attribute__((target("avx2"))) static void
+span_multiply_avx2(uint32_t *dst, int count, uint32_t add, uint32_t scale) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)add), zero);
+  __m256i k = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)scale), zero);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i lo = multiply_avx2(_mm256_unpacklo_epi8(d, zero), a, k);
+    __m256i hi = multiply_avx2(_mm256_unpackhi_epi8(d, zero), a, k);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  span_multiply_scalar(dst + i, count - i, add, scale);
+}
+
+// Blends two widened pixels of `s` into `d`; `mode` is a constant.
+__attribute__((target("sse2"), always_inline)) static inline __m128i
+composite_px_sse2(__m128i d, __m128i s, SpanBlend mode) {
+  const __m128i full = _mm_set1_epi16(255);
+  __m128i sa = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  switch (mode) {
+  case SPAN_BLEND_REPLACE:
+    return s;
+  case SPAN_BLEND_MULTIPLY: {
+    __m128i da = _mm_shufflehi_epi16(
+        _mm_shufflelo_epi16(d, _MM_SHUFFLE(3, 3, 3, 3)),
+        _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i k = _mm_add_epi16(_mm_sub_epi16(full, sa), s);
+    return div255_sse2(_mm_add_epi16(
+        _mm_mullo_epi16(s, _mm_sub_epi16(full, da)), _mm_mullo_epi16(d, k)));
+  }
+  case SPAN_BLEND_SCREEN:
+    return _mm_add_epi16(
+        s, div255_sse2(_mm_mullo_epi16(d, _mm_sub_epi16(full, s))));
+  case SPAN_BLEND_ERASE:
+    return div255_sse2(_mm_mullo_epi16(d, _mm_sub_epi16(full, sa)));
+  case SPAN_BLEND_OVER:
+  default:
+    return _mm_add_epi16(
+        s, div255_sse2(_mm_mullo_epi16(d, _mm_sub_epi16(full, sa))));
+  }
+}
+
+__attribute__((target("sse2"), always_inline)) static inline void
+composite_sse2(uint32_t *dst, const uint32_t *src, int count,
+               uint32_t opacity, SpanBlend mode) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i op = _mm_set1_epi16((short)opacity);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    if (opacity != 255) {
+      s_lo = div255_sse2(_mm_mullo_epi16(s_lo, op));
+      s_hi = div255_sse2(_mm_mullo_epi16(s_hi, op));
+    }
+    __m128i lo = composite_px_sse2(_mm_unpacklo_epi8(d, zero), s_lo, mode);
+    __m128i hi = composite_px_sse2(_mm_unpackhi_epi8(d, zero), s_hi, mode);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  composite_scalar(dst + i, src + i, count - i, opacity, mode);
+}
+
+__attribute__((target("sse2"))) static void
+composite_replace_sse2(uint32_t *dst, const uint32_t *src, int count,
+                       uint32_t opacity) {
+  composite_sse2(dst, src, count, opacity, SPAN_BLEND_REPLACE);
+}
+
+__attribute__((target("sse2"))) static void
+composite_over_sse2(uint32_t *dst, const uint32_t *src, int count,
+                    uint32_t opacity) {
+  composite_sse2(dst, src, count, opacity, SPAN_BLEND_OVER);
+}
+
+__attribute__((target("sse2"))) static void
+composite_multiply_sse2(uint32_t *dst, const uint32_t *src, int count,
+                        uint32_t opacity) {
+  composite_sse2(dst, src, count, opacity, SPAN_BLEND_MULTIPLY);
+}
+
+__attribute__((target("sse2"))) static void
+composite_screen_sse2(uint32_t *dst, const uint32_t *src, int count,
+                      uint32_t opacity) {
+  composite_sse2(dst, src, count, opacity, SPAN_BLEND_SCREEN);
+}
+
+__attribute__((target("sse2"))) static void
+composite_erase_sse2(uint32_t *dst, const uint32_t *src, int count,
+                     uint32_t opacity) {
+  composite_sse2(dst, src, count, opacity, SPAN_BLEND_ERASE);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+composite_px_avx2(__m256i d, __m256i s, SpanBlend mode) {
+  const __m256i full = _mm256_set1_epi16(255);
+  __m256i sa = _mm256_shufflehi_epi16(
+      _mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+      _MM_SHUFFLE(3, 3, 3, 3));
+  switch (mode) {
+  case SPAN_BLEND_REPLACE:
+    return s;
+  case SPAN_BLEND_MULTIPLY: {
+    __m256i da = _mm256_shufflehi_epi16(
+        _mm256_shufflelo_epi16(d, _MM_SHUFFLE(3, 3, 3, 3)),
+        _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i k = _mm256_add_epi16(_mm256_sub_epi16(full, sa), s);
+    return div255_avx2(
+        _mm256_add_epi16(_mm256_mullo_epi16(s, _mm256_sub_epi16(full, da)),
+                         _mm256_mullo_epi16(d, k)));
+  }
+  case SPAN_BLEND_SCREEN:
+    return _mm256_add_epi16(
+        s, div255_avx2(_mm256_mullo_epi16(d, _mm256_sub_epi16(full, s))));
+  case SPAN_BLEND_ERASE:
+    return div255_avx2(_mm256_mullo_epi16(d, _mm256_sub_epi16(full, sa)));
+  case SPAN_BLEND_OVER:
+  default:
+    return _mm256_add_epi16(
+        s, div255_avx2(_mm256_mullo_epi16(d, _mm256_sub_epi16(full, sa))));
+  }
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void
+composite_avx2(uint32_t *dst, const uint32_t *src, int count,
+               uint32_t opacity, SpanBlend mode) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i op = _mm256_set1_epi16((short)opacity);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+    __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+    if (opacity != 255) {
+      s_lo = div255_avx2(_mm256_mullo_epi16(s_lo, op));
+      s_hi = div255_avx2(_mm256_mullo_epi16(s_hi, op));
+    }
+    __m256i lo = composite_px_avx2(_mm256_unpacklo_epi8(d, zero), s_lo, mode);
+    __m256i hi = composite_px_avx2(_mm256_unpackhi_epi8(d, zero), s_hi, mode);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  composite_scalar(dst + i, src + i, count - i, opacity, mode);
+}
+
+__attribute__((target("avx2"))) static void
+composite_replace_avx2(uint32_t *dst, const uint32_t *src, int count,
+                       uint32_t opacity) {
+  composite_avx2(dst, src, count, opacity, SPAN_BLEND_REPLACE);
+}
+
+__attribute__((target("avx2"))) static void
+composite_over_avx2(uint32_t *dst, const uint32_t *src, int count,
+                    uint32_t opacity) {
+  composite_avx2(dst, src, count, opacity, SPAN_BLEND_OVER);
+}
+
+__attribute__((target("avx2"))) static void
+composite_multiply_avx2(uint32_t *dst, const uint32_t *src, int count,
+                        uint32_t opacity) {
+  composite_avx2(dst, src, count, opacity, SPAN_BLEND_MULTIPLY);
+}
+
+__attribute__((target("avx2"))) static void
+composite_screen_avx2(uint32_t *dst, const uint32_t *src, int count,
+                      uint32_t opacity) {
+  composite_avx2(dst, src, count, opacity, SPAN_BLEND_SCREEN);
+}
+
+__attribute__((target("avx2"))) static void
+composite_erase_avx2(uint32_t *dst, const uint32_t *src, int count,
+                     uint32_t opacity) {
+  composite_avx2(dst, src, count, opacity, SPAN_BLEND_ERASE);
+}
+
+// Eight lookups per gather; SSE2 has no gather, so it keeps the scalar loop.
+__attribute__((target("avx2"))) static void
+span_expand_avx2(uint32_t *dst, const uint8_t *src, int count,
+                 const uint32_t *palette) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i idx =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+    __m256i px = _mm256_i32gather_epi32((const int *)palette, idx, 4);
+    _mm256_storeu_si256((__m256i *)(dst + i), px);
+  }
+  span_expand_scalar(dst + i, src + i, count - i, palette);
+}
+
+// Rows are summed vertically in 16-bit lanes, then each register's 64-bit
+// halves are regrouped so that adding them sums horizontal neighbours.
+__attribute__((target("sse2"))) static void
+span_downsample_sse2(uint32_t *dst, const uint32_t *row0, const uint32_t *row1,
+                     int count) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i two = _mm_set1_epi16(2);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * i));
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + 2 * i + 4));
+    __m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + 2 * i));
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * i + 4));
+    __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                               _mm_unpacklo_epi8(b0, zero));
+    __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                               _mm_unpackhi_epi8(b0, zero));
+    __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                               _mm_unpacklo_epi8(b1, zero));
+    __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                               _mm_unpackhi_epi8(b1, zero));
+    __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                               _mm_unpackhi_epi64(s0, s1));
+    __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                               _mm_unpackhi_epi64(s2, s3));
+    h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+    h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(h0, h1));
+  }
+  span_downsample_scalar(dst + i, row0 + 2 * i, row1 + 2 * i, count - i);
+}
+
+// Same as the SSE2 loop per 128-bit lane; the final pack interleaves the
+// lanes' results, which one cross-lane permute puts back in order.
+__attribute__((target("avx2"))) static void
+span_downsample_avx2(uint32_t *dst, const uint32_t *row0, const uint32_t *row1,
+                     int count) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i two = _mm256_set1_epi16(2);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * i + 8));
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * i + 8));
+    __m256i s0 = _mm256_add_epi16(_mm256_unpacklo_epi8(a0, zero),
+                                  _mm256_unpacklo_epi8(b0, zero));
+    __m256i s1 = _mm256_add_epi16(_mm256_unpackhi_epi8(a0, zero),
+                                  _mm256_unpackhi_epi8(b0, zero));
+    __m256i s2 = _mm256_add_epi16(_mm256_unpacklo_epi8(a1, zero),
+                                  _mm256_unpacklo_epi8(b1, zero));
+    __m256i s3 = _mm256_add_epi16(_mm256_unpackhi_epi8(a1, zero),
+                                  _mm256_unpackhi_epi8(b1, zero));
+    __m256i h0 = _mm256_add_epi16(_mm256_unpacklo_epi64(s0, s1),
+                                  _mm256_unpackhi_epi64(s0, s1));
+    __m256i h1 = _mm256_add_epi16(_mm256_unpacklo_epi64(s2, s3),
+                                  _mm256_unpackhi_epi64(s2, s3));
+    h0 = _mm256_srli_epi16(_mm256_add_epi16(h0, two), 2);
+    h1 = _mm256_srli_epi16(_mm256_add_epi16(h1, two), 2);
+    __m256i packed = _mm256_packus_epi16(h0, h1);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  span_downsample_sse2(dst + i, row0 + 2 * i, row1 + 2 * i, count - i);
+}
+
+static const SpanCompositeFn composite_sse2_fns[SPAN_BLEND_COUNT] = {
+    composite_replace_sse2, composite_over_sse2, composite_multiply_sse2,
+    composite_screen_sse2, composite_erase_sse2};
+
+static const SpanCompositeFn composite_avx2_fns[SPAN_BLEND_COUNT] = {
+    composite_replace_avx2, composite_over_avx2, composite_multiply_avx2,
+    composite_screen_avx2, composite_erase_avx2};
+#endif
+
+static SpanFillFn fill_impl = NULL;
+static SpanMixFn scale_add_impl = span_scale_add_scalar;
+static SpanMixFn multiply_impl = span_multiply_scalar;
+static const SpanCompositeFn *composite_impl = composite_scalar_fns;
+static SpanExpandFn expand_impl = span_expand_scalar;
+static SpanDownsampleFn downsample_impl = span_downsample_scalar;
+static const char *backend_name = "scalar";
+
+static void span_select(void) {
+  fill_impl = span_fill_scalar;
+  backend_name = "scalar";
+
+#ifdef SPAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    fill_impl = span_fill_avx2;
+    scale_add_impl = span_scale_add_avx2;
+    multiply_impl = span_multiply_avx2;
+    composite_impl = composite_avx2_fns;
+    expand_impl = span_expand_avx2;
+    downsample_impl = span_downsample_avx2;
+    backend_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    fill_impl = span_fill_sse2;
+    scale_add_impl = span_scale_add_sse2;
+    multiply_impl = span_multiply_sse2;
+    composite_impl = composite_sse2_fns;
+    downsample_impl = span_downsample_sse2;
+    backend_name = "sse2";
+  }
+#endif
+}
+
+void span_fill(uint32_t *dst, int count, uint32_t color) {
+  if (count <= 0)
+    return;
+  if (!fill_impl)
+    span_select();
+
+  // Short runs (thin brushes, outlines) are cheaper without the alignment
+  // prologue and dispatch overhead.
+  if (count < 8) {
+    span_fill_scalar(dst, count, color);
+    return;
+  }
+
+  fill_impl(dst, count, color);
+}
+
+void span_blend(uint32_t *dst, int count, uint32_t color, SpanBlend mode) {
+  if (count <= 0)
+    return;
+  if (!fill_impl)
+    span_select();
+
+  uint32_t alpha = color >> 24;
+  uint32_t inv_alpha = (255 - alpha) * 0x01010101u;
+  uint32_t add;
+  uint32_t scale;
+  SpanMixFn mix = scale_add_impl;
+  SpanMixFn mix_short = span_scale_add_scalar;
+  switch (mode) {
+  case SPAN_BLEND_OVER:
+    if (alpha == 255) {
+      span_fill(dst, count, color);
+      return;
+    }
+    if (color == 0)
+      return;
+    add = color;
+    scale = inv_alpha;
+    break;
+  case SPAN_BLEND_MULTIPLY:
+    // s * (1 - da) + d * (1 - sa) + s * d, with the last two terms sharing
+    // the per-channel factor (255 - sa + s).
+    add = color;
+    scale = inv_alpha + color;
+    mix = multiply_impl;
+    mix_short = span_multiply_scalar;
+    break;
+  case SPAN_BLEND_SCREEN:
+    // s + d - s * d == s + d * (255 - s) / 255
+    add = color;
+    scale = ~color;
+    break;
+  case SPAN_BLEND_ERASE:
+    if (alpha == 0)
+      return;
+    add = 0;
+    scale = inv_alpha;
+    break;
+  case SPAN_BLEND_REPLACE:
+  default:
+    span_fill(dst, count, color);
+    return;
+  }
+
+  if (count < 8)
+    mix_short(dst, count, add, scale);
+  else
+    mix(dst, count, add, scale);
+}
+
+void span_composite(uint32_t *dst, const uint32_t *src, int count,
+                    int opacity, SpanBlend mode) {
+  if (mode < 0 || mode >= SPAN_BLEND_COUNT)
+    mode = SPAN_BLEND_OVER;
+  if (opacity < 0)
+    opacity = 0;
+  if (opacity > 255)
+    opacity = 255;
+  if (count <= 0 || (opacity == 0 && mode != SPAN_BLEND_REPLACE))
+    return;
+  if (!fill_impl)
+    span_select();
+  composite_impl[mode](dst, src, count, (uint32_t)opacity);
+}
+
+void span_expand(uint32_t *dst, const uint8_t *src, int count,
+                 const uint32_t *palette) {
+  if (count <= 0)
+    return;
+  if (!fill_impl)
+    span_select();
+  expand_impl(dst, src, count, palette);
+}
+
+void span_downsample(uint32_t *dst, const uint32_t *row0,
+                     const uint32_t *row1, int count) {
+  if (count <= 0)
+    return;
+  if (!fill_impl)
+    span_select();
+  downsample_impl(dst, row0, row1, count);
+}
+
+const char *span_blend_name(SpanBlend mode) {
+  switch (mode) {
+  case SPAN_BLEND_REPLACE:
+    return "REPLACE";
+  case SPAN_BLEND_OVER:
+    return "NORMAL";
+  case SPAN_BLEND_MULTIPLY:
+    return "MULTIPLY";
+  case SPAN_BLEND_SCREEN:
+    return "SCREEN";
+  case SPAN_BLEND_ERASE:
+    return "ERASE";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+const char *span_backend_name(void) {
+  if (!fill_impl)
+    span_select();
+  return backend_name;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+// Writes `count` copies of `color` starting at `dst`. The implementation is
+// picked once at first use from the SIMD extensions the CPU reports.
+void span_fill(uint32_t *dst, int count, uint32_t color);
+
+// How a painted color combines with what is already there. Colors and pixels
+// are premultiplied ARGB; every mode treats alpha like the color channels.
+typedef enum {
+  SPAN_BLEND_REPLACE = 0, // overwrite, alpha ignored
+  SPAN_BLEND_OVER,        // source over destination
+  SPAN_BLEND_MULTIPLY,
+  SPAN_BLEND_SCREEN,
+  SPAN_BLEND_ERASE, // removes coverage in proportion to the color's alpha
+  SPAN_BLEND_COUNT
+} SpanBlend;
+
+// Blends `color` into `count` pixels at `dst`. The mode is resolved once per
+// call into one of two specialized loops, each with SIMD variants picked the
+// same way as span_fill's.
+void span_blend(uint32_t *dst, int count, uint32_t color, SpanBlend mode);
+
+// Blends a row of premultiplied `src` pixels into `dst`, scaling the source
+// by `opacity` (0-255) first. Transparent source pixels leave `dst` alone in
+// every mode but replace. Each mode has its own loop per backend.
+void span_composite(uint32_t *dst, const uint32_t *src, int count,
+                    int opacity, SpanBlend mode);
+
+// Looks up `count` palette indices from `src` and writes the colors to `dst`.
+void span_expand(uint32_t *dst, const uint8_t *src, int count,
+                 const uint32_t *palette);
+
+// Halves two rows in both directions: dst[i] is the rounded average of
+// row0[2i], row0[2i + 1], row1[2i] and row1[2i + 1], per channel.
+void span_downsample(uint32_t *dst, const uint32_t *row0,
+                     const uint32_t *row1, int count);
+
+const char *span_blend_name(SpanBlend mode);
+const char *span_backend_name(void);
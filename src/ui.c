@@ -2,8 +2,64 @@
 
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UI_ATLAS_WIDTH 512
+
+// Renders every glyph once and packs them into rows of one surface. Each
+// glyph is rendered as a one-character string, so its box is exactly its
+// advance by the font's height and glyphs drawn side by side line up.
+static int build_atlas(UI *ui) {
+  TTF_Font *font = (TTF_Font *)ui->font;
+  SDL_Color white = {255, 255, 255, 255};
+  SDL_Surface *rendered[UI_GLYPH_COUNT];
+  int h = TTF_FontHeight(font);
+  int x = 0;
+  int y = 0;
+
+  for (int i = 0; i < UI_GLYPH_COUNT; i++) {
+    char s[2] = {(char)(UI_GLYPH_FIRST + i), '\0'};
+    int w = 0;
+    int unused;
+    TTF_SizeUTF8(font, s, &w, &unused);
+    rendered[i] = TTF_RenderUTF8_Blended(font, s, white);
+    if (x + w > UI_ATLAS_WIDTH) {
+      x = 0;
+      y += h;
+    }
+    SDL_Rect src = {x, y, w, h};
+    ui->glyphs[i].src = src;
+    x += w;
+  }
+
+  SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(
+      0, UI_ATLAS_WIDTH, y + h, 32, SDL_PIXELFORMAT_ARGB8888);
+  if (atlas)
+    SDL_FillRect(atlas, NULL, 0);
+  for (int i = 0; i < UI_GLYPH_COUNT; i++) {
+    if (!rendered[i])
+      continue;
+    if (atlas) {
+      SDL_Rect src = {0, 0, ui->glyphs[i].src.w, h};
+      SDL_Rect dst = ui->glyphs[i].src;
+      SDL_SetSurfaceBlendMode(rendered[i], SDL_BLENDMODE_NONE);
+      SDL_BlitSurface(rendered[i], &src, atlas, &dst);
+    }
+    SDL_FreeSurface(rendered[i]);
+  }
+  if (!atlas)
+    return 0;
+
+  ui->line_height = h;
+  ui->atlas_pixels = atlas;
+  ui->atlas_w = atlas->w;
+  ui->atlas_h = atlas->h;
+  return 1;
+}
 
 int ui_init(UI *ui, const char *font_path, int pt_size) {
+  memset(ui, 0, sizeof(*ui));
   if (TTF_Init() != 0)
     return 0;
 
@@ -14,6 +70,12 @@ int ui_init(UI *ui, const char *font_path, int pt_size) {
   }
 
   ui->font = font;
+  if (!build_atlas(ui)) {
+    TTF_CloseFont(font);
+    ui->font = NULL;
+    TTF_Quit();
+    return 0;
+  }
   return 1;
 }
 
@@ -21,45 +83,73 @@ void ui_destroy(UI *ui) {
   if (!ui)
     return;
 
+  if (ui->atlas)
+    SDL_DestroyTexture(ui->atlas);
+  if (ui->atlas_pixels)
+    SDL_FreeSurface(ui->atlas_pixels);
+  free(ui->vertices);
+  free(ui->indices);
   if (ui->font) {
     TTF_CloseFont((TTF_Font *)ui->font);
     ui->font = NULL;
   }
   TTF_Quit();
+  memset(ui, 0, sizeof(*ui));
 }
 
-int ui_text_make(UI *ui, SDL_Renderer *r, UIText *out, const char *text) {
-  if (!ui || !ui->font || !out || !text)
-    return 0;
+static const UIGlyph *glyph_for(const UI *ui, char c) {
+  int i = (unsigned char)c - UI_GLYPH_FIRST;
+  if (i < 0 || i >= UI_GLYPH_COUNT)
+    i = '?' - UI_GLYPH_FIRST;
+  return &ui->glyphs[i];
+}
 
-  SDL_Color c = {255, 255, 255, 220};
-  SDL_Surface *s = TTF_RenderUTF8_Blended((TTF_Font *)ui->font, text, c);
-  if (!s)
-    return 0;
+void ui_text_size(const UI *ui, const char *text, int *w, int *h) {
+  int width = 0;
+  if (ui && ui->font && text) {
+    for (const char *p = text; *p; p++) {
+      width += glyph_for(ui, *p)->src.w;
+    }
+  }
+  if (w)
+    *w = width;
+  if (h)
+    *h = ui && ui->font ? ui->line_height : 0;
+}
+
+// Grows the quad buffers to hold `glyphs` glyphs. They only ever grow, so
+// once the longest label has been drawn no string allocates again.
+static int reserve(UI *ui, int glyphs) {
+  if (glyphs <= ui->glyph_capacity)
+    return 1;
+  int capacity = ui->glyph_capacity ? ui->glyph_capacity : 64;
+  while (capacity < glyphs)
+    capacity *= 2;
 
-  SDL_Texture *t = SDL_CreateTextureFromSurface(r, s);
-  if (!t) {
-    SDL_FreeSurface(s);
+  SDL_Vertex *vertices =
+      (SDL_Vertex *)realloc(ui->vertices, sizeof(SDL_Vertex) * 4 * capacity);
+  if (!vertices)
     return 0;
-  }
+  ui->vertices = vertices;
+  int *indices = (int *)realloc(ui->indices, sizeof(int) * 6 * capacity);
+  if (!indices)
+    return 0;
+  ui->indices = indices;
 
-  out->tex = t;
-  out->w = s->w;
-  out->h = s->h;
-  SDL_FreeSurface(s);
+  for (int i = ui->glyph_capacity; i < capacity; i++) {
+    int v = i * 4;
+    int *q = indices + i * 6;
+    q[0] = v;
+    q[1] = v + 1;
+    q[2] = v + 2;
+    q[3] = v + 2;
+    q[4] = v + 1;
+    q[5] = v + 3;
+  }
+  ui->glyph_capacity = capacity;
   return 1;
 }
 
-void ui_text_destroy(UIText *t) {
-  if (!t)
-    return;
-  if (t->tex)
-    SDL_DestroyTexture(t->tex);
-  t->tex = NULL;
-  t->w = 0;
-  t->h = 0;
-}
-
 void ui_draw_panel(SDL_Renderer *r, int x, int y, int w, int h) {
   SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_BLEND);
 
@@ -71,7 +161,49 @@ void ui_draw_panel(SDL_Renderer *r, int x, int y, int w, int h) {
   SDL_RenderDrawRect(r, &panel);
 }
 
-void ui_draw_text(SDL_Renderer *r, const UIText *t, int x, int y) {
-  SDL_Rect dst = {x, y, t->w, t->h};
-  SDL_RenderCopy(r, t->tex, NULL, &dst);
+void ui_draw_text(UI *ui, SDL_Renderer *r, const char *text, int x, int y) {
+  if (!ui || !ui->font || !text || !text[0])
+    return;
+
+  // The texture needs a renderer, so it is only made on first use.
+  if (!ui->atlas) {
+    if (!ui->atlas_pixels)
+      return;
+    ui->atlas = SDL_CreateTextureFromSurface(r, ui->atlas_pixels);
+    if (!ui->atlas)
+      return;
+    SDL_SetTextureBlendMode(ui->atlas, SDL_BLENDMODE_BLEND);
+    SDL_FreeSurface(ui->atlas_pixels);
+    ui->atlas_pixels = NULL;
+  }
+
+  if (!reserve(ui, (int)strlen(text)))
+    return;
+
+  SDL_Color color = {255, 255, 255, 220};
+  float sx = 1.0f / (float)ui->atlas_w;
+  float sy = 1.0f / (float)ui->atlas_h;
+  int count = 0;
+  int pen = x;
+  for (const char *p = text; *p; p++) {
+    const SDL_Rect *g = &glyph_for(ui, *p)->src;
+    if (*p != ' ' && g->w > 0) {
+      SDL_Vertex *v = ui->vertices + count * 4;
+      for (int corner = 0; corner < 4; corner++) {
+        int cx = corner & 1;
+        int cy = corner >> 1;
+        v[corner].position.x = (float)(pen + cx * g->w);
+        v[corner].position.y = (float)(y + cy * g->h);
+        v[corner].color = color;
+        v[corner].tex_coord.x = (float)(g->x + cx * g->w) * sx;
+        v[corner].tex_coord.y = (float)(g->y + cy * g->h) * sy;
+      }
+      count++;
+    }
+    pen += g->w;
+  }
+
+  if (count > 0)
+    SDL_RenderGeometry(r, ui->atlas, ui->vertices, count * 4, ui->indices,
+                       count * 6);
 }
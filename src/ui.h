@@ -2,21 +2,37 @@
 
 #include <SDL2/SDL.h>
 
+// Printable ASCII; any other byte is drawn as '?'.
+#define UI_GLYPH_FIRST 32
+#define UI_GLYPH_COUNT 95
+
+// Where a glyph sits in the atlas. Its width is also its advance.
 typedef struct {
-  SDL_Texture *tex;
-  int w;
-  int h;
-} UIText;
+  SDL_Rect src;
+} UIGlyph;
 
+// Text is drawn from a glyph atlas rasterized once in ui_init, one batch of
+// textured quads per string, so changing labels cost no allocation and no
+// font rendering.
 typedef struct {
   void *font;
+  int line_height;
+  UIGlyph glyphs[UI_GLYPH_COUNT];
+  SDL_Surface *atlas_pixels; // until the first draw turns it into `atlas`
+  SDL_Texture *atlas;
+  int atlas_w;
+  int atlas_h;
+
+  SDL_Vertex *vertices; // four per glyph, reused between strings
+  int *indices;         // six per glyph, the same pattern for every string
+  int glyph_capacity;
 } UI;
 
 int ui_init(UI *ui, const char *font_path, int pt_size);
 void ui_destroy(UI *ui);
 
-int ui_text_make(UI *ui, SDL_Renderer *r, UIText *out, const char *text);
-void ui_text_destroy(UIText *t);
+// Size of `text` when drawn with ui_draw_text.
+void ui_text_size(const UI *ui, const char *text, int *w, int *h);
 
 void ui_draw_panel(SDL_Renderer *r, int x, int y, int w, int h);
-void ui_draw_text(SDL_Renderer *r, const UIText *t, int x, int y);
+void ui_draw_text(UI *ui, SDL_Renderer *r, const char *text, int x, int y);
@@ -25,10 +25,10 @@ int ui_button_init(UIButton *btn, int x, int y, int w, int h,
       return 0;
   }
 
-  btn->text = NULL;
   btn->hovered = 0;
   btn->pressed = 0;
   btn->enabled = 1;
+  btn->dirty = 1;
   btn->on_click = NULL;
   btn->user_data = NULL;
 
@@ -41,12 +41,6 @@ void ui_button_destroy(UIButton *btn) {
 
   free(btn->label);
   btn->label = NULL;
-
-  if (btn->text) {
-    ui_text_destroy(btn->text);
-    free(btn->text);
-    btn->text = NULL;
-  }
 }
 
 void ui_button_set_callback(UIButton *btn, void (*on_click)(void *),
@@ -65,12 +59,16 @@ int ui_button_handle_event(UIButton *btn, const UIEvent *event) {
 
   switch (event->type) {
   case UI_EVENT_MOUSE_MOVE:
-    btn->hovered = inside;
+    if (btn->hovered != inside) {
+      btn->hovered = inside;
+      btn->dirty = 1;
+    }
     return inside;
 
   case UI_EVENT_MOUSE_DOWN:
     if (inside) {
       btn->pressed = 1;
+      btn->dirty = 1;
       return 1;
     }
     break;
@@ -78,11 +76,15 @@ int ui_button_handle_event(UIButton *btn, const UIEvent *event) {
   case UI_EVENT_MOUSE_UP:
     if (btn->pressed && inside) {
       btn->pressed = 0;
+      btn->dirty = 1;
       if (btn->on_click)
         btn->on_click(btn->user_data);
       return 1;
     }
-    btn->pressed = 0;
+    if (btn->pressed) {
+      btn->pressed = 0;
+      btn->dirty = 1;
+    }
     break;
 
   default:
@@ -123,22 +125,11 @@ void ui_button_render(const UIButton *btn, SDL_Renderer *r, UI *ui) {
   }
 
   if (btn->label && ui && ui->font) {
-    if (!btn->text) {
-      UIButton *mutable_btn = (UIButton *) btn;
-      mutable_btn->text = (UIText *) malloc(sizeof(UIText));
-      if (mutable_btn->text) {
-        if (!ui_text_make(ui, r, mutable_btn->text, btn->label)) {
-          free(mutable_btn->text);
-          mutable_btn->text = NULL;
-        }
-      }
-    }
-
-    if (btn->text && btn->text->tex) {
-      int text_x = btn->bounds.x + (btn->bounds.w - btn->text->w) / 2;
-      int text_y = btn->bounds.y + (btn->bounds.h - btn->text->h) / 2;
-      ui_draw_text(r, btn->text, text_x, text_y);
-    }
+    int text_w, text_h;
+    ui_text_size(ui, btn->label, &text_w, &text_h);
+    int text_x = btn->bounds.x + (btn->bounds.w - text_w) / 2;
+    int text_y = btn->bounds.y + (btn->bounds.h - text_h) / 2;
+    ui_draw_text(ui, r, btn->label, text_x, text_y);
   }
 }
 
@@ -156,6 +147,7 @@ int ui_color_picker_init(UIColorPicker *picker, int x, int y, int swatch_size,
   picker->swatch_size = swatch_size;
   picker->selected_index = 0;
   picker->hovered_index = -1;
+  picker->dirty = 1;
   picker->on_color_change = NULL;
   picker->user_data = NULL;
 
@@ -186,7 +178,20 @@ void ui_color_picker_set_callback(UIColorPicker *picker,
 void ui_color_picker_set_selected(UIColorPicker *picker, int index) {
   if (!picker || index < 0 || index >= picker->color_count)
     return;
-  picker->selected_index = index;
+  if (picker->selected_index != index) {
+    picker->selected_index = index;
+    picker->dirty = 1;
+  }
+}
+
+void ui_color_picker_set_color(UIColorPicker *picker, int index,
+                               uint32_t color) {
+  if (!picker || index < 0 || index >= picker->color_count)
+    return;
+  if (picker->colors[index] != color) {
+    picker->colors[index] = color;
+    picker->dirty = 1;
+  }
 }
 
 int ui_color_picker_handle_event(UIColorPicker *picker, const UIEvent *event) {
@@ -196,15 +201,17 @@ int ui_color_picker_handle_event(UIColorPicker *picker, const UIEvent *event) {
   int inside = ui_rect_contains(&picker->bounds, event->x, event->y);
 
   if (event->type == UI_EVENT_MOUSE_MOVE) {
+    int hovered = -1;
     if (inside) {
       int offset_x = event->x - picker->bounds.x;
       int index = offset_x / (picker->swatch_size + 4);
-      if (index >= 0 && index < picker->color_count) {
-        picker->hovered_index = index;
-        return 1;
-      }
+      if (index >= 0 && index < picker->color_count)
+        hovered = index;
+    }
+    if (picker->hovered_index != hovered) {
+      picker->hovered_index = hovered;
+      picker->dirty = 1;
     }
-    picker->hovered_index = -1;
     return inside;
   }
 
@@ -213,6 +220,7 @@ int ui_color_picker_handle_event(UIColorPicker *picker, const UIEvent *event) {
     int index = offset_x / (picker->swatch_size + 4);
     if (index >= 0 && index < picker->color_count) {
       picker->selected_index = index;
+      picker->dirty = 1;
       if (picker->on_color_change)
         picker->on_color_change(picker->colors[index], picker->user_data);
       return 1;
@@ -272,6 +280,7 @@ int ui_toolbar_init(UIToolbar *toolbar, int x, int y, int horizontal) {
   toolbar->selected_index = -1;
   toolbar->horizontal = horizontal;
   toolbar->spacing = 4;
+  toolbar->dirty = 1;
 
   return 1;
 }
@@ -332,7 +341,10 @@ int ui_toolbar_add_button(UIToolbar *toolbar, const char *label,
 void ui_toolbar_set_selected(UIToolbar *toolbar, int index) {
   if (!toolbar || index < -1 || index >= toolbar->button_count)
     return;
-  toolbar->selected_index = index;
+  if (toolbar->selected_index != index) {
+    toolbar->selected_index = index;
+    toolbar->dirty = 1;
+  }
 }
 
 int ui_toolbar_handle_event(UIToolbar *toolbar, const UIEvent *event, UI *ui) {
@@ -341,11 +353,20 @@ int ui_toolbar_handle_event(UIToolbar *toolbar, const UIEvent *event, UI *ui) {
 
   (void) ui;
 
+  // Every button sees moves, so the one the pointer came from loses its
+  // hover state.
+  if (event->type == UI_EVENT_MOUSE_MOVE) {
+    int hover = 0;
+    for (int i = 0; i < toolbar->button_count; i++) {
+      hover |= ui_button_handle_event(&toolbar->buttons[i], event);
+    }
+    return hover;
+  }
+
   for (int i = 0; i < toolbar->button_count; i++) {
     if (ui_button_handle_event(&toolbar->buttons[i], event)) {
-      if (event->type == UI_EVENT_MOUSE_UP) {
-        toolbar->selected_index = i;
-      }
+      if (event->type == UI_EVENT_MOUSE_UP)
+        ui_toolbar_set_selected(toolbar, i);
       return 1;
     }
   }
@@ -394,6 +415,7 @@ int ui_slider_init(UISlider *slider, int x, int y, int w, int h,
   slider->max_value = max_val;
   slider->current_value = clamp_int(initial_val, min_val, max_val);
   slider->dragging = 0;
+  slider->dirty = 1;
 
   slider->label = NULL;
   if (label) {
@@ -402,7 +424,6 @@ int ui_slider_init(UISlider *slider, int x, int y, int w, int h,
       return 0;
   }
 
-  slider->label_text = NULL;
   slider->on_value_change = NULL;
   slider->user_data = NULL;
 
@@ -415,12 +436,6 @@ void ui_slider_destroy(UISlider *slider) {
 
   free(slider->label);
   slider->label = NULL;
-
-  if (slider->label_text) {
-    ui_text_destroy(slider->label_text);
-    free(slider->label_text);
-    slider->label_text = NULL;
-  }
 }
 
 void ui_slider_set_callback(UISlider *slider,
@@ -435,7 +450,11 @@ void ui_slider_set_callback(UISlider *slider,
 void ui_slider_set_value(UISlider *slider, int value) {
   if (!slider)
     return;
-  slider->current_value = clamp_int(value, slider->min_value, slider->max_value);
+  value = clamp_int(value, slider->min_value, slider->max_value);
+  if (slider->current_value != value) {
+    slider->current_value = value;
+    slider->dirty = 1;
+  }
 }
 
 int ui_slider_get_value(const UISlider *slider) {
@@ -467,12 +486,14 @@ int ui_slider_handle_event(UISlider *slider, const UIEvent *event) {
   case UI_EVENT_MOUSE_DOWN:
     if (inside_handle || inside_track) {
       slider->dragging = 1;
+      slider->dirty = 1;
       int new_value = slider->min_value +
                       (int)(((float)(event->x - track_x) / (float)track_w) *
                             (slider->max_value - slider->min_value));
       new_value = clamp_int(new_value, slider->min_value, slider->max_value);
       if (new_value != slider->current_value) {
         slider->current_value = new_value;
+        slider->dirty = 1;
         if (slider->on_value_change)
           slider->on_value_change(slider->current_value, slider->user_data);
       }
@@ -483,6 +504,7 @@ int ui_slider_handle_event(UISlider *slider, const UIEvent *event) {
   case UI_EVENT_MOUSE_UP:
     if (slider->dragging) {
       slider->dragging = 0;
+      slider->dirty = 1;
       return 1;
     }
     break;
@@ -495,6 +517,7 @@ int ui_slider_handle_event(UISlider *slider, const UIEvent *event) {
       new_value = clamp_int(new_value, slider->min_value, slider->max_value);
       if (new_value != slider->current_value) {
         slider->current_value = new_value;
+        slider->dirty = 1;
         if (slider->on_value_change)
           slider->on_value_change(slider->current_value, slider->user_data);
       }
@@ -542,32 +565,13 @@ void ui_slider_render(const UISlider *slider, SDL_Renderer *r, UI *ui) {
   SDL_RenderDrawRect(r, &handle);
 
   if (slider->label && ui && ui->font) {
-    if (!slider->label_text) {
-      UISlider *mutable_slider = (UISlider *)slider;
-      mutable_slider->label_text = (UIText *)malloc(sizeof(UIText));
-      if (mutable_slider->label_text) {
-        char label_with_value[128];
-        snprintf(label_with_value, sizeof(label_with_value), "%s: %d",
-                 slider->label, slider->current_value);
-        if (!ui_text_make(ui, r, mutable_slider->label_text,
-                          label_with_value)) {
-          free(mutable_slider->label_text);
-          mutable_slider->label_text = NULL;
-        }
-      }
-    } else {
-      ui_text_destroy(slider->label_text);
-      char label_with_value[128];
-      snprintf(label_with_value, sizeof(label_with_value), "%s: %d",
-               slider->label, slider->current_value);
-      ui_text_make(ui, r, slider->label_text, label_with_value);
-    }
-
-    if (slider->label_text && slider->label_text->tex) {
-      int text_x = slider->bounds.x;
-      int text_y = slider->bounds.y - slider->label_text->h - 4;
-      ui_draw_text(r, slider->label_text, text_x, text_y);
-    }
+    char label_with_value[128];
+    snprintf(label_with_value, sizeof(label_with_value), "%s: %d",
+             slider->label, slider->current_value);
+    int text_h;
+    ui_text_size(ui, label_with_value, NULL, &text_h);
+    ui_draw_text(ui, r, label_with_value, slider->bounds.x,
+                 slider->bounds.y - text_h - 4);
   }
 }
 
@@ -580,30 +584,25 @@ int ui_status_bar_init(UIStatusBar *bar, int x, int y, int w, int h) {
   bar->bounds.w = w;
   bar->bounds.h = h;
   bar->text[0] = '\0';
-  bar->rendered_text = NULL;
   bar->dirty = 1;
 
   return 1;
 }
 
 void ui_status_bar_destroy(UIStatusBar *bar) {
-  if (!bar)
-    return;
-
-  if (bar->rendered_text) {
-    ui_text_destroy(bar->rendered_text);
-    free(bar->rendered_text);
-    bar->rendered_text = NULL;
-  }
+  // The text is drawn straight from the glyph atlas; nothing is owned.
+  (void)bar;
 }
 
 void ui_status_bar_set_text(UIStatusBar *bar, const char *text) {
   if (!bar || !text)
     return;
+  if (strncmp(bar->text, text, sizeof(bar->text) - 1) == 0)
+    return;
 
+  bar->dirty = 1;
   strncpy(bar->text, text, sizeof(bar->text) - 1);
   bar->text[sizeof(bar->text) - 1] = '\0';
-  bar->dirty = 1;
 }
 
 void ui_status_bar_render(const UIStatusBar *bar, SDL_Renderer *r, UI *ui) {
@@ -618,30 +617,442 @@ void ui_status_bar_render(const UIStatusBar *bar, SDL_Renderer *r, UI *ui) {
   SDL_SetRenderDrawColor(r, 100, 100, 100, 200);
   SDL_RenderDrawRect(r, &bg);
 
-  if (bar->dirty && ui && ui->font) {
-    UIStatusBar *mutable_bar = (UIStatusBar *)bar;
-    if (mutable_bar->rendered_text) {
-      ui_text_destroy(mutable_bar->rendered_text);
-      free(mutable_bar->rendered_text);
-      mutable_bar->rendered_text = NULL;
+  if (bar->text[0] != '\0' && ui && ui->font) {
+    int text_h;
+    ui_text_size(ui, bar->text, NULL, &text_h);
+    int text_x = bar->bounds.x + 8;
+    int text_y = bar->bounds.y + (bar->bounds.h - text_h) / 2;
+    ui_draw_text(ui, r, bar->text, text_x, text_y);
+  }
+}
+
+void ui_overlay_init(UIOverlay *overlay) {
+  memset(overlay, 0, sizeof(*overlay));
+  overlay->invalid = 1;
+  overlay->hovered = -1;
+  overlay->capture = -1;
+}
+
+void ui_overlay_destroy(UIOverlay *overlay) {
+  if (!overlay)
+    return;
+  if (overlay->texture)
+    SDL_DestroyTexture(overlay->texture);
+  free(overlay->hit_cells);
+  memset(overlay, 0, sizeof(*overlay));
+}
+
+int ui_overlay_add(UIOverlay *overlay, UIItemType type, void *widget) {
+  if (!overlay || !widget || overlay->item_count == UI_OVERLAY_MAX_ITEMS)
+    return 0;
+  UIOverlayItem *item = &overlay->items[overlay->item_count++];
+  item->type = type;
+  item->widget = widget;
+  memset(&item->drawn, 0, sizeof(item->drawn));
+  overlay->invalid = 1;
+  overlay->hit_valid = 0;
+  return 1;
+}
+
+void ui_overlay_invalidate(UIOverlay *overlay) {
+  if (!overlay)
+    return;
+  overlay->invalid = 1;
+  overlay->hit_valid = 0;
+}
+
+static int rect_empty(const UIRect *r) {
+  return r->w <= 0 || r->h <= 0;
+}
+
+static void rect_union(UIRect *acc, const UIRect *r) {
+  if (rect_empty(r))
+    return;
+  if (rect_empty(acc)) {
+    *acc = *r;
+    return;
+  }
+  int left = acc->x < r->x ? acc->x : r->x;
+  int top = acc->y < r->y ? acc->y : r->y;
+  int right = acc->x + acc->w > r->x + r->w ? acc->x + acc->w : r->x + r->w;
+  int bottom = acc->y + acc->h > r->y + r->h ? acc->y + acc->h : r->y + r->h;
+  acc->x = left;
+  acc->y = top;
+  acc->w = right - left;
+  acc->h = bottom - top;
+}
+
+static int rect_overlaps(const UIRect *a, const UIRect *b) {
+  return !rect_empty(a) && !rect_empty(b) && a->x < b->x + b->w &&
+         b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+static int item_dirty(const UIOverlayItem *item) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR: {
+    const UIToolbar *toolbar = (const UIToolbar *) item->widget;
+    for (int i = 0; i < toolbar->button_count; i++) {
+      if (toolbar->buttons[i].dirty)
+        return 1;
     }
+    return toolbar->dirty;
+  }
+  case UI_ITEM_COLOR_PICKER:
+    return ((const UIColorPicker *) item->widget)->dirty;
+  case UI_ITEM_SLIDER:
+    return ((const UISlider *) item->widget)->dirty;
+  case UI_ITEM_BUTTON:
+    return ((const UIButton *) item->widget)->dirty;
+  case UI_ITEM_STATUS_BAR:
+    return ((const UIStatusBar *) item->widget)->dirty;
+  }
+  return 0;
+}
 
-    if (bar->text[0] != '\0') {
-      mutable_bar->rendered_text = (UIText *)malloc(sizeof(UIText));
-      if (mutable_bar->rendered_text) {
-        if (ui_text_make(ui, r, mutable_bar->rendered_text, bar->text)) {
-          mutable_bar->dirty = 0;
-        } else {
-          free(mutable_bar->rendered_text);
-          mutable_bar->rendered_text = NULL;
-        }
+static void item_clean(UIOverlayItem *item) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR: {
+    UIToolbar *toolbar = (UIToolbar *) item->widget;
+    for (int i = 0; i < toolbar->button_count; i++) {
+      toolbar->buttons[i].dirty = 0;
+    }
+    toolbar->dirty = 0;
+  } break;
+  case UI_ITEM_COLOR_PICKER:
+    ((UIColorPicker *) item->widget)->dirty = 0;
+    break;
+  case UI_ITEM_SLIDER:
+    ((UISlider *) item->widget)->dirty = 0;
+    break;
+  case UI_ITEM_BUTTON:
+    ((UIButton *) item->widget)->dirty = 0;
+    break;
+  case UI_ITEM_STATUS_BAR:
+    ((UIStatusBar *) item->widget)->dirty = 0;
+    break;
+  }
+}
+
+// The area a widget draws into, which can be more than its bounds: the
+// toolbar outlines the selected button, and the slider handle overhangs the
+// track with the label above it.
+static UIRect item_extent(const UIOverlayItem *item, const UI *ui) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR: {
+    UIRect r = ((const UIToolbar *) item->widget)->bounds;
+    r.x -= 2;
+    r.y -= 2;
+    r.w += 4;
+    r.h += 4;
+    return r;
+  }
+  case UI_ITEM_COLOR_PICKER:
+    return ((const UIColorPicker *) item->widget)->bounds;
+  case UI_ITEM_SLIDER: {
+    const UISlider *slider = (const UISlider *) item->widget;
+    UIRect r = {slider->bounds.x - 6, slider->bounds.y, slider->bounds.w + 12,
+                slider->bounds.h};
+    if (slider->label && ui && ui->font) {
+      char label_with_value[128];
+      snprintf(label_with_value, sizeof(label_with_value), "%s: %d",
+               slider->label, slider->current_value);
+      int text_w, text_h;
+      ui_text_size(ui, label_with_value, &text_w, &text_h);
+      UIRect label = {slider->bounds.x, slider->bounds.y - text_h - 4, text_w,
+                      text_h};
+      rect_union(&r, &label);
+    }
+    return r;
+  }
+  case UI_ITEM_BUTTON:
+    return ((const UIButton *) item->widget)->bounds;
+  case UI_ITEM_STATUS_BAR:
+    return ((const UIStatusBar *) item->widget)->bounds;
+  }
+  UIRect none = {0, 0, 0, 0};
+  return none;
+}
+
+static void item_render(const UIOverlayItem *item, SDL_Renderer *r, UI *ui) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR:
+    ui_toolbar_render((const UIToolbar *) item->widget, r, ui);
+    break;
+  case UI_ITEM_COLOR_PICKER:
+    ui_color_picker_render((const UIColorPicker *) item->widget, r);
+    break;
+  case UI_ITEM_SLIDER:
+    ui_slider_render((const UISlider *) item->widget, r, ui);
+    break;
+  case UI_ITEM_BUTTON:
+    ui_button_render((const UIButton *) item->widget, r, ui);
+    break;
+  case UI_ITEM_STATUS_BAR:
+    ui_status_bar_render((const UIStatusBar *) item->widget, r, ui);
+    break;
+  }
+}
+
+int ui_overlay_dirty(const UIOverlay *overlay) {
+  if (!overlay)
+    return 0;
+  if (overlay->invalid)
+    return 1;
+  for (int i = 0; i < overlay->item_count; i++) {
+    if (item_dirty(&overlay->items[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Makes the texture match a w x h window. What is drawn into it is already
+// premultiplied by alpha, so it is put on screen with a blend mode that does
+// not multiply again. Returns 0 if the renderer can't do either.
+static int overlay_texture(UIOverlay *overlay, SDL_Renderer *r, int w, int h) {
+  if (overlay->texture && overlay->w == w && overlay->h == h)
+    return 1;
+  if (overlay->texture)
+    SDL_DestroyTexture(overlay->texture);
+  overlay->texture = NULL;
+  overlay->invalid = 1;
+  if (!SDL_RenderTargetSupported(r))
+    return 0;
+
+  overlay->texture = SDL_CreateTexture(r, SDL_PIXELFORMAT_ARGB8888,
+                                       SDL_TEXTUREACCESS_TARGET, w, h);
+  if (!overlay->texture)
+    return 0;
+  SDL_BlendMode premultiplied = SDL_ComposeCustomBlendMode(
+      SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+      SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE,
+      SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+  if (SDL_SetTextureBlendMode(overlay->texture, premultiplied) != 0) {
+    SDL_DestroyTexture(overlay->texture);
+    overlay->texture = NULL;
+    return 0;
+  }
+  overlay->w = w;
+  overlay->h = h;
+  return 1;
+}
+
+static void overlay_clean(UIOverlay *overlay) {
+  for (int i = 0; i < overlay->item_count; i++) {
+    item_clean(&overlay->items[i]);
+  }
+  overlay->invalid = 0;
+}
+
+void ui_overlay_update(UIOverlay *overlay, SDL_Renderer *r, UI *ui, int w,
+                       int h) {
+  if (!overlay || !r)
+    return;
+  if (overlay->direct || w <= 0 || h <= 0) {
+    overlay_clean(overlay);
+    return;
+  }
+  if (!overlay_texture(overlay, r, w, h)) {
+    overlay->direct = 1;
+    overlay_clean(overlay);
+    return;
+  }
+
+  // Clear and redraw the area each changed widget covered before and covers
+  // now. Widgets overlapping it are drawn again as well, clipped to it.
+  UIRect damage = {0, 0, 0, 0};
+  for (int i = 0; i < overlay->item_count; i++) {
+    UIOverlayItem *item = &overlay->items[i];
+    if (!overlay->invalid && !item_dirty(item))
+      continue;
+    UIRect extent = item_extent(item, ui);
+    rect_union(&damage, &item->drawn);
+    rect_union(&damage, &extent);
+    item->drawn = extent;
+  }
+  if (overlay->invalid) {
+    UIRect all = {0, 0, w, h};
+    damage = all;
+  }
+  overlay_clean(overlay);
+  if (rect_empty(&damage))
+    return;
+
+  SDL_SetRenderTarget(r, overlay->texture);
+  SDL_Rect clip = {damage.x, damage.y, damage.w, damage.h};
+  SDL_RenderSetClipRect(r, &clip);
+  SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_NONE);
+  SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+  SDL_RenderFillRect(r, &clip);
+  for (int i = 0; i < overlay->item_count; i++) {
+    if (rect_overlaps(&overlay->items[i].drawn, &damage))
+      item_render(&overlay->items[i], r, ui);
+  }
+  SDL_RenderSetClipRect(r, NULL);
+  SDL_SetRenderTarget(r, NULL);
+}
+
+void ui_overlay_render(const UIOverlay *overlay, SDL_Renderer *r, UI *ui) {
+  if (!overlay || !r)
+    return;
+  if (overlay->texture && !overlay->direct) {
+    SDL_Rect dst = {0, 0, overlay->w, overlay->h};
+    SDL_RenderCopy(r, overlay->texture, NULL, &dst);
+    return;
+  }
+  for (int i = 0; i < overlay->item_count; i++) {
+    item_render(&overlay->items[i], r, ui);
+  }
+}
+
+// Where a widget reacts to the pointer: its bounds, plus the part of the
+// slider handle that overhangs the track. The status bar doesn't.
+static UIRect item_hit_rect(const UIOverlayItem *item) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR:
+    return ((const UIToolbar *) item->widget)->bounds;
+  case UI_ITEM_COLOR_PICKER:
+    return ((const UIColorPicker *) item->widget)->bounds;
+  case UI_ITEM_SLIDER: {
+    UIRect r = ((const UISlider *) item->widget)->bounds;
+    r.x -= 6;
+    r.w += 12;
+    return r;
+  }
+  case UI_ITEM_BUTTON:
+    return ((const UIButton *) item->widget)->bounds;
+  case UI_ITEM_STATUS_BAR:
+    break;
+  }
+  UIRect none = {0, 0, 0, 0};
+  return none;
+}
+
+static int item_handle_event(UIOverlayItem *item, const UIEvent *event,
+                             UI *ui) {
+  switch (item->type) {
+  case UI_ITEM_TOOLBAR:
+    return ui_toolbar_handle_event((UIToolbar *) item->widget, event, ui);
+  case UI_ITEM_COLOR_PICKER:
+    return ui_color_picker_handle_event((UIColorPicker *) item->widget, event);
+  case UI_ITEM_SLIDER:
+    return ui_slider_handle_event((UISlider *) item->widget, event);
+  case UI_ITEM_BUTTON:
+    return ui_button_handle_event((UIButton *) item->widget, event);
+  case UI_ITEM_STATUS_BAR:
+    break;
+  }
+  return 0;
+}
+
+static void hit_index_build(UIOverlay *overlay) {
+  overlay->hit_valid = 1;
+  int right = 0, bottom = 0;
+  for (int i = 0; i < overlay->item_count; i++) {
+    UIRect r = item_hit_rect(&overlay->items[i]);
+    if (rect_empty(&r))
+      continue;
+    if (r.x + r.w > right)
+      right = r.x + r.w;
+    if (r.y + r.h > bottom)
+      bottom = r.y + r.h;
+  }
+  int cols = (right + UI_HIT_CELL - 1) / UI_HIT_CELL;
+  int rows = (bottom + UI_HIT_CELL - 1) / UI_HIT_CELL;
+
+  free(overlay->hit_cells);
+  overlay->hit_cells = NULL;
+  overlay->hit_cols = cols;
+  overlay->hit_rows = rows;
+  if (cols == 0 || rows == 0)
+    return;
+  overlay->hit_cells = (uint32_t *) calloc((size_t) cols * rows,
+                                           sizeof(uint32_t));
+  if (!overlay->hit_cells)
+    return;
+
+  for (int i = 0; i < overlay->item_count; i++) {
+    UIRect r = item_hit_rect(&overlay->items[i]);
+    if (rect_empty(&r) || r.x + r.w <= 0 || r.y + r.h <= 0)
+      continue;
+    int x0 = r.x > 0 ? r.x / UI_HIT_CELL : 0;
+    int y0 = r.y > 0 ? r.y / UI_HIT_CELL : 0;
+    int x1 = (r.x + r.w - 1) / UI_HIT_CELL;
+    int y1 = (r.y + r.h - 1) / UI_HIT_CELL;
+    for (int cy = y0; cy <= y1; cy++) {
+      for (int cx = x0; cx <= x1; cx++) {
+        overlay->hit_cells[cy * cols + cx] |= (uint32_t) 1 << i;
       }
     }
   }
+}
 
-  if (bar->rendered_text && bar->rendered_text->tex) {
-    int text_x = bar->bounds.x + 8;
-    int text_y = bar->bounds.y + (bar->bounds.h - bar->rendered_text->h) / 2;
-    ui_draw_text(r, bar->rendered_text, text_x, text_y);
+// The items whose hit area contains (x, y), as a bit set.
+static uint32_t hit_test(UIOverlay *overlay, int x, int y) {
+  if (!overlay->hit_valid)
+    hit_index_build(overlay);
+
+  uint32_t candidates;
+  if (overlay->hit_cells) {
+    if (x < 0 || y < 0)
+      return 0;
+    int cx = x / UI_HIT_CELL;
+    int cy = y / UI_HIT_CELL;
+    if (cx >= overlay->hit_cols || cy >= overlay->hit_rows)
+      return 0;
+    candidates = overlay->hit_cells[cy * overlay->hit_cols + cx];
+  } else {
+    candidates = overlay->item_count == 32
+                     ? ~(uint32_t) 0
+                     : ((uint32_t) 1 << overlay->item_count) - 1;
   }
+
+  uint32_t hits = 0;
+  while (candidates) {
+    int i = __builtin_ctz(candidates);
+    candidates &= candidates - 1;
+    UIRect r = item_hit_rect(&overlay->items[i]);
+    if (ui_rect_contains(&r, x, y))
+      hits |= (uint32_t) 1 << i;
+  }
+  return hits;
+}
+
+static int top_item(uint32_t items) {
+  return items ? 31 - __builtin_clz(items) : -1;
+}
+
+int ui_overlay_dispatch(UIOverlay *overlay, const UIEvent *event, UI *ui) {
+  if (!overlay || !event)
+    return 0;
+
+  if (overlay->capture >= 0) {
+    item_handle_event(&overlay->items[overlay->capture], event, ui);
+    if (event->type == UI_EVENT_MOUSE_UP)
+      overlay->capture = -1;
+    return 1;
+  }
+
+  uint32_t hits = hit_test(overlay, event->x, event->y);
+
+  if (event->type == UI_EVENT_MOUSE_MOVE) {
+    // The widget the pointer left sees it move away, which clears its
+    // hover state.
+    int top = top_item(hits);
+    if (overlay->hovered >= 0 && overlay->hovered != top)
+      item_handle_event(&overlay->items[overlay->hovered], event, ui);
+    overlay->hovered = top;
+    return top >= 0 && item_handle_event(&overlay->items[top], event, ui);
+  }
+
+  // Widgets can overlap where one only reacts to part of its area, so the
+  // press goes down the stack until one takes it.
+  for (int i = top_item(hits); i >= 0; i = top_item(hits)) {
+    hits &= ~((uint32_t) 1 << i);
+    if (item_handle_event(&overlay->items[i], event, ui)) {
+      if (event->type == UI_EVENT_MOUSE_DOWN)
+        overlay->capture = i;
+      return 1;
+    }
+  }
+  return 0;
 }
@@ -30,10 +30,10 @@ typedef struct UIButton UIButton;
 struct UIButton {
   UIRect bounds;
   char *label;
-  UIText *text;
   int hovered;
   int pressed;
   int enabled;
+  int dirty; // looks different from when it was last drawn
   void (*on_click)(void *user_data);
   void *user_data;
 };
@@ -45,6 +45,7 @@ typedef struct {
   int selected_index;
   int swatch_size;
   int hovered_index;
+  int dirty;
   void (*on_color_change)(uint32_t color, void *user_data);
   void *user_data;
 } UIColorPicker;
@@ -56,6 +57,7 @@ typedef struct {
   int selected_index;
   int horizontal;
   int spacing;
+  int dirty; // the selection moved; the buttons track their own state
 } UIToolbar;
 
 int ui_rect_contains(const UIRect *rect, int x, int y);
@@ -75,6 +77,8 @@ void ui_color_picker_set_callback(UIColorPicker *picker,
                                   void (*on_color_change)(uint32_t, void *),
                                   void *user_data);
 void ui_color_picker_set_selected(UIColorPicker *picker, int index);
+void ui_color_picker_set_color(UIColorPicker *picker, int index,
+                               uint32_t color);
 int ui_color_picker_handle_event(UIColorPicker *picker, const UIEvent *event);
 void ui_color_picker_render(const UIColorPicker *picker, SDL_Renderer *r);
 
@@ -92,8 +96,8 @@ typedef struct {
   int max_value;
   int current_value;
   int dragging;
+  int dirty;
   char *label;
-  UIText *label_text;
   void (*on_value_change)(int value, void *user_data);
   void *user_data;
 } UISlider;
@@ -113,7 +117,6 @@ void ui_slider_render(const UISlider *slider, SDL_Renderer *r, UI *ui);
 typedef struct {
   UIRect bounds;
   char text[256];
-  UIText *rendered_text;
   int dirty;
 } UIStatusBar;
 
@@ -121,3 +124,79 @@ int ui_status_bar_init(UIStatusBar *bar, int x, int y, int w, int h);
 void ui_status_bar_destroy(UIStatusBar *bar);
 void ui_status_bar_set_text(UIStatusBar *bar, const char *text);
 void ui_status_bar_render(const UIStatusBar *bar, SDL_Renderer *r, UI *ui);
+
+typedef enum {
+  UI_ITEM_TOOLBAR,
+  UI_ITEM_COLOR_PICKER,
+  UI_ITEM_SLIDER,
+  UI_ITEM_BUTTON,
+  UI_ITEM_STATUS_BAR
+} UIItemType;
+
+typedef struct {
+  UIItemType type;
+  void *widget;
+  UIRect drawn; // area it covered when last drawn
+} UIOverlayItem;
+
+// At most one per bit of a hit-test cell.
+#define UI_OVERLAY_MAX_ITEMS 32
+
+// Side of the squares of the hit-test index.
+#define UI_HIT_CELL 64
+
+// The top level of the widget tree; the toolbar passes events on to its own
+// buttons.
+//
+// The widgets are drawn into a cached window-sized texture that is put on
+// screen with one copy. Only widgets that changed since the last frame are
+// drawn again, together with whatever overlaps the area they cover. If the
+// renderer can't draw into textures, every widget is drawn every frame.
+//
+// Pointer events go only to the widgets under the pointer, found through a
+// grid of cells that each list the widgets reaching into them, so their cost
+// doesn't grow with the number of widgets. A widget that takes a button press
+// captures the pointer and gets every event until the button is released.
+typedef struct {
+  SDL_Texture *texture;
+  int w;
+  int h;
+  int direct;  // no render target support
+  int invalid; // everything has to be redrawn
+  UIOverlayItem items[UI_OVERLAY_MAX_ITEMS];
+  int item_count;
+
+  // Covers (0, 0) to the far corner of the widgets. Bit i of a cell is set
+  // when item i can be hit there. NULL if out of memory; every item is
+  // tested then.
+  uint32_t *hit_cells;
+  int hit_cols;
+  int hit_rows;
+  int hit_valid;
+  int hovered; // item under the pointer, or -1
+  int capture; // item holding the pointer, or -1
+} UIOverlay;
+
+void ui_overlay_init(UIOverlay *overlay);
+void ui_overlay_destroy(UIOverlay *overlay);
+
+// Adds a widget, drawn above the ones added before. The widget must stay at
+// the same address while the overlay is in use.
+int ui_overlay_add(UIOverlay *overlay, UIItemType type, void *widget);
+
+// Redraws everything on the next update and rebuilds the hit-test index,
+// e.g. after widgets were moved or the renderer lost its render targets.
+void ui_overlay_invalidate(UIOverlay *overlay);
+
+// Passes a pointer event to the widget holding the pointer or else to the
+// topmost widget under it that uses it. Returns 1 if a widget used it.
+int ui_overlay_dispatch(UIOverlay *overlay, const UIEvent *event, UI *ui);
+
+// Whether a widget changed since the last update.
+int ui_overlay_dirty(const UIOverlay *overlay);
+
+// Brings the cached texture up to date with a w x h window. Must be called
+// before drawing of the frame starts, as it switches the render target.
+void ui_overlay_update(UIOverlay *overlay, SDL_Renderer *r, UI *ui, int w,
+                       int h);
+void ui_overlay_render(const UIOverlay *overlay, SDL_Renderer *r, UI *ui);